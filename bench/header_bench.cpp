@@ -0,0 +1,143 @@
+#include "../tar.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct LegacyHeader {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag[1];
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+};
+
+/**
+ * @brief Header encoder as it was before the fixed-width encoder: a TarData
+ * with string copies, sprintf for every field and a signed checksum loop
+ */
+void legacy_encode(std::string const &filename, uint64_t length, char *tmp)
+{
+	tar::TarData data;
+	data.filename = filename;
+	data.uname = "nobody";
+	data.gname = "nogroup";
+	data.uid = 65534;
+	data.gid = 65534;
+	data.mode = 0644;
+	data.typeflag = '0';
+	data.length = length;
+
+	memset(tmp, 0, 512);
+	LegacyHeader *h = (LegacyHeader *)tmp;
+	memcpy(h->name, data.filename.c_str(), std::min(100, (int)data.filename.size()));
+	sprintf(h->mode, "%07o", data.mode);
+	sprintf(h->uid, "%07o", data.uid);
+	sprintf(h->gid, "%07o", data.gid);
+	snprintf(h->size, sizeof(h->size), "%011llo", (unsigned long long)data.length);
+	sprintf(h->mtime, "%011o", 014202150465);
+	memset(h->chksum, ' ', 8);
+	h->typeflag[0] = data.typeflag;
+	memcpy(h->magic, "ustar ", 6);
+	memcpy(h->version, " ", 1);
+	memcpy(h->uname, data.uname.c_str(), std::min(sizeof(h->uname), data.uname.size()));
+	memcpy(h->gname, data.gname.c_str(), std::min(sizeof(h->gname), data.gname.size()));
+	unsigned sum = 0;
+	for (int i = 0; i < 512; i++) {
+		sum += tmp[i];
+	}
+	sprintf(h->chksum, "%06o", sum);
+}
+
+/**
+ * @brief Header encoder used by TarWriter
+ */
+void fast_encode(std::string const &filename, uint64_t length, char *tmp)
+{
+	tar::HeaderInfo info;
+	info.name = filename;
+	info.uname = "nobody";
+	info.gname = "nogroup";
+	info.uid = 65534;
+	info.gid = 65534;
+	info.mode = 0644;
+	info.mtime = 014202150465;
+	info.size = length;
+	tar::encode_header(info, tmp);
+}
+
+/**
+ * @brief Encode headers for all names and return headers per second
+ */
+double run(void (*encode)(std::string const &, uint64_t, char *), std::vector<std::string> const &names, int rounds, uint32_t *digest)
+{
+	char block[512];
+	uint32_t d = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < names.size(); i++) {
+			encode(names[i], i * 37, block);
+			d = d * 31 + (unsigned char)block[148] + (unsigned char)block[153];
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	*digest = d;
+	double sec = std::chrono::duration<double>(end - start).count();
+	return names.size() * (double)rounds / sec;
+}
+
+} // namespace
+
+/**
+ * @brief Microbenchmark of the tar header encoder
+ *
+ * Usage: header_bench [rounds]
+ */
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+	if (rounds < 1) rounds = 1;
+
+	std::vector<std::string> names;
+	char tmp[100];
+	for (int i = 0; i < 100000; i++) {
+		snprintf(tmp, sizeof(tmp), "project/src/module%d/file_%06d.txt", i % 97, i);
+		names.push_back(tmp);
+	}
+
+	// Both encoders must produce identical blocks for ASCII names
+	char a[512];
+	char b[512];
+	for (size_t i = 0; i < names.size(); i += 997) {
+		legacy_encode(names[i], i * 37, a);
+		fast_encode(names[i], i * 37, b);
+		if (memcmp(a, b, 512) != 0) {
+			fprintf(stderr, "error: header mismatch: %s\n", names[i].c_str());
+			return 1;
+		}
+	}
+
+	uint32_t d1;
+	uint32_t d2;
+	double legacy = run(legacy_encode, names, rounds, &d1);
+	double fast = run(fast_encode, names, rounds, &d2);
+	printf("legacy: %12.0f headers/s\n", legacy);
+	printf("fast:   %12.0f headers/s (%.1fx)\n", fast, fast / legacy);
+	return d1 == d2 ? 0 : 1;
+}
@@ -0,0 +1,502 @@
+#include "../joinpath.h"
+#include "../misc.h"
+#include "../tar.h"
+#include "../tzst.h"
+#include "../zs.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <ftw.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief Corpus shape
+ */
+struct CorpusSpec {
+	char const *name;
+	char const *description;
+	uint64_t files;
+	uint64_t file_size;
+	int compressible_percent; // share of files with text-like content, the rest is random
+	int depth; // directory depth of every file
+};
+
+// quick: a few seconds per corpus, for use before every commit
+static const CorpusSpec QUICK[] = {
+	{ "small", "20000 x 1 KB text files", 20000, 1 << 10, 100, 1 },
+	{ "large", "4 x 64 MB files, half random", 4, 64 << 20, 50, 0 },
+	{ "mixed", "2000 x 64 KB files, 70% text, 30% random", 2000, 64 << 10, 70, 2 },
+	{ "deep", "5000 x 4 KB files under 24-level paths", 5000, 4 << 10, 100, 24 },
+};
+
+// full: production-sized trees, needs about 120 GB of free space
+static const CorpusSpec FULL[] = {
+	{ "small", "1M x 1 KB text files", 1000000, 1 << 10, 100, 1 },
+	{ "large", "100 x 1 GB files, half random", 100, 1 << 30, 50, 0 },
+	{ "mixed", "100000 x 64 KB files, 70% text, 30% random", 100000, 64 << 10, 70, 2 },
+	{ "deep", "100000 x 4 KB files under 24-level paths", 100000, 4 << 10, 100, 24 },
+};
+
+/**
+ * @brief Timing of one stage
+ */
+struct Stage {
+	char const *name;
+	double wall_ms = 0;
+	double cpu_ms = 0;
+	uint64_t bytes = 0; // bytes processed by the stage (0: not applicable)
+};
+
+/**
+ * @brief Wall clock and process CPU time measurement
+ */
+class StageTimer {
+private:
+	std::chrono::steady_clock::time_point wall_;
+	double cpu_ = 0;
+	static double cpu_now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+	}
+public:
+	StageTimer()
+	{
+		start();
+	}
+	/**
+	 * @brief Start the timer
+	 */
+	void start()
+	{
+		wall_ = std::chrono::steady_clock::now();
+		cpu_ = cpu_now();
+	}
+	/**
+	 * @brief Record the time since start() into a stage
+	 * @param stage Stage to add the time to
+	 */
+	void stop(Stage *stage) const
+	{
+		stage->wall_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wall_).count();
+		stage->cpu_ms += cpu_now() - cpu_;
+	}
+};
+
+/**
+ * @brief Deterministic pseudo-random generator (xorshift64*)
+ */
+class Random {
+private:
+	uint64_t s_;
+public:
+	explicit Random(uint64_t seed)
+		: s_(seed * 0x9E3779B97F4A7C15ull + 1)
+	{
+	}
+	uint64_t next()
+	{
+		s_ ^= s_ >> 12;
+		s_ ^= s_ << 25;
+		s_ ^= s_ >> 27;
+		return s_ * 0x2545F4914F6CDD1Dull;
+	}
+};
+
+/**
+ * @brief Fill a buffer with text-like data
+ *
+ * Words are drawn from a small vocabulary, which compresses roughly like
+ * source code or configuration files.
+ */
+void fill_text(Random *rnd, char *p, size_t len)
+{
+	static char const *const words[] = {
+		"the", "value", "return", "const", "struct", "include", "error", "size_t",
+		"config", "server", "enabled", "true", "false", "name", "path", "buffer",
+		"{", "}", "(", ")", ";", "=", "0", "1", "//", "if", "for", "while",
+	};
+	const int nwords = sizeof(words) / sizeof(*words);
+	size_t i = 0;
+	while (i < len) {
+		uint64_t r = rnd->next();
+		char const *w = words[r % nwords];
+		while (*w && i < len) {
+			p[i++] = *w++;
+		}
+		if (i < len) {
+			p[i++] = (r >> 32) % 8 == 0 ? '\n' : ' ';
+		}
+	}
+}
+
+/**
+ * @brief Fill a buffer with incompressible data
+ */
+void fill_random(Random *rnd, char *p, size_t len)
+{
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t r = rnd->next();
+		memcpy(p + i, &r, 8);
+	}
+	for (; i < len; i++) {
+		p[i] = (char)rnd->next();
+	}
+}
+
+/**
+ * @brief Write a file with generated content
+ * @return true if successful, false otherwise
+ */
+bool write_file(std::string const &path, uint64_t size, bool text, Random *rnd, std::vector<char> *buf)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "error: could not create file: %s\n", path.c_str());
+		return false;
+	}
+	bool ok = true;
+	while (ok && size > 0) {
+		size_t n = (size_t)std::min<uint64_t>(size, buf->size());
+		if (text) {
+			fill_text(rnd, buf->data(), n);
+		} else {
+			fill_random(rnd, buf->data(), n);
+		}
+		ok = write(fd, buf->data(), n) == (ssize_t)n;
+		size -= n;
+	}
+	close(fd);
+	if (!ok) {
+		fprintf(stderr, "error: failed to write file: %s\n", path.c_str());
+	}
+	return ok;
+}
+
+/**
+ * @brief Remove a directory tree
+ */
+void remove_tree(std::string const &path)
+{
+	nftw(path.c_str(), [](char const *p, struct stat const *, int, struct FTW *){
+		return remove(p);
+	}, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * @brief Generate a corpus unless an identical one already exists
+ *
+ * Content depends only on the spec, so a corpus left over from a previous
+ * run is reused. A stamp file written last marks a complete corpus.
+ * @param spec Corpus shape
+ * @param dir Corpus directory
+ * @return true if successful, false otherwise
+ */
+bool generate(CorpusSpec const &spec, std::string const &dir)
+{
+	char stamp[256];
+	snprintf(stamp, sizeof(stamp), "%llu %llu %d %d\n", (unsigned long long)spec.files, (unsigned long long)spec.file_size, spec.compressible_percent, spec.depth);
+	std::string stamp_path = dir + ".stamp";
+	{
+		char tmp[256] = {};
+		FILE *fp = fopen(stamp_path.c_str(), "r");
+		if (fp) {
+			size_t n = fread(tmp, 1, sizeof(tmp) - 1, fp);
+			fclose(fp);
+			if (n == strlen(stamp) && memcmp(tmp, stamp, n) == 0) return true;
+		}
+	}
+	fprintf(stderr, "generating %s ...\n", dir.c_str());
+	remove(stamp_path.c_str());
+	remove_tree(dir);
+
+	// Seed from the corpus name (FNV-1a) so that content is the same everywhere
+	uint64_t seed = 0xcbf29ce484222325ull;
+	for (char const *p = spec.name; *p; p++) {
+		seed = (seed ^ (unsigned char)*p) * 0x100000001b3ull;
+	}
+	Random rnd(seed);
+	std::vector<char> buf(1 << 20);
+	for (uint64_t i = 0; i < spec.files; i++) {
+		// Spread files over directories of at most 1000 entries each
+		std::string path = dir;
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "d%03llu", (unsigned long long)(i / 1000));
+		path = path / tmp;
+		for (int d = 1; d < spec.depth; d++) {
+			snprintf(tmp, sizeof(tmp), "level%02d_%s", d, "subdirectory_with_a_long_name");
+			path = path / tmp;
+		}
+		if (i % 1000 == 0 && !misc::mkdirs(path)) {
+			fprintf(stderr, "error: could not create directory: %s\n", path.c_str());
+			return false;
+		}
+		bool text = (int)(i % 100) < spec.compressible_percent;
+		snprintf(tmp, sizeof(tmp), "file%07llu.%s", (unsigned long long)i, text ? "txt" : "bin");
+		if (!write_file(path / tmp, spec.file_size, text, &rnd, &buf)) return false;
+	}
+
+	FILE *fp = fopen(stamp_path.c_str(), "w");
+	if (!fp) return false;
+	fputs(stamp, fp);
+	fclose(fp);
+	return true;
+}
+
+/**
+ * @brief Run all stages on one corpus
+ * @param opt Archive options
+ * @param src Corpus directory
+ * @param work Scratch directory for archives and extracted trees
+ * @param stages Output stage timings
+ * @param files Output number of files
+ * @param input_bytes Output total size of the files
+ * @param archive_bytes Output size of the archive
+ * @return true if successful, false otherwise
+ */
+bool run_corpus(tzst::Option const &opt, std::string const &src, std::string const &work, std::vector<Stage> *stages, uint64_t *files, uint64_t *input_bytes, uint64_t *archive_bytes)
+{
+	Stage scan { "scan" };
+	Stage framing { "tar" };
+	Stage compress { "compress" };
+	Stage output { "write" };
+	Stage decompress { "decompress" };
+	Stage extract { "extract" };
+	Stage archive_e2e { "archive_e2e" };
+	Stage extract_e2e { "extract_e2e" };
+
+	const std::string archive_path = work / "bench.tar.zst";
+	const std::string extract_dir = work / "extract";
+	bool ok = true;
+
+	// Scan
+	std::vector<misc::FileItem> items;
+	{
+		StageTimer t;
+		misc::scan_files(src, {}, &items);
+		t.stop(&scan);
+	}
+	*files = items.size();
+	*input_bytes = 0;
+	for (misc::FileItem const &item : items) {
+		*input_bytes += item.size;
+	}
+	scan.bytes = *input_bytes;
+	const std::string prefix = tar::TarWriter::archive_prefix(src, {});
+
+	// Tar framing of the scanned files, including source reads, into a null sink
+	{
+		uint64_t total = 0;
+		tar::TarWriter tar([&](char const *, int len){
+			total += len;
+			return len;
+		});
+		tar.set_verbose(opt.verbose);
+		StageTimer t;
+		ok = tar.archive(items, prefix) && ok;
+		t.stop(&framing);
+		framing.bytes = total;
+	}
+
+	// Compression of the tar stream: time spent in the compressor, less the
+	// time spent writing its output, which is the write stage
+	{
+		int fd = open(archive_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "error: could not create file: %s\n", archive_path.c_str());
+			return false;
+		}
+		StageTimer tw;
+		ZS::Compressor zs(opt.zsopt, [&](char const *ptr, int len){
+			tw.start();
+			int r = write(fd, ptr, len) == len ? len : -1;
+			tw.stop(&output);
+			output.bytes += len;
+			return r;
+		});
+		StageTimer tc;
+		Stage inner;
+		tar::TarWriter tar([&](char const *ptr, int len){
+			tc.start();
+			bool r = zs.write(ptr, len);
+			tc.stop(&inner);
+			compress.bytes += len;
+			return r ? len : -1;
+		});
+		tar.set_verbose(opt.verbose);
+		if (opt.store_incompressible) {
+			tar.set_store_callback([&](bool store){
+				zs.set_store(store);
+			});
+		}
+		ok = tar.archive(items, prefix) && ok;
+		tc.start();
+		ok = zs.finish() && ok;
+		tc.stop(&inner);
+		close(fd);
+		compress.wall_ms = inner.wall_ms - output.wall_ms;
+		compress.cpu_ms = inner.cpu_ms - output.cpu_ms;
+	}
+
+	// Decompression into a null sink
+	{
+		int fd = open(archive_path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "error: could not open file: %s\n", archive_path.c_str());
+			return false;
+		}
+		ZS zs;
+		StageTimer t;
+		ok = zs.decompress(opt.zsopt, [&](char *ptr, int len){
+			return (int)read(fd, ptr, len);
+		}, [&](char const *, int len){
+			decompress.bytes += len;
+			return len;
+		}) && ok;
+		t.stop(&decompress);
+		close(fd);
+	}
+
+	// Extraction: decompression, tar parsing and file writes
+	{
+		remove_tree(extract_dir);
+		misc::mkdirs(extract_dir);
+		StageTimer t;
+		ok = tzst::extract_tar_zst(opt, archive_path, extract_dir) && ok;
+		t.stop(&extract);
+		extract.bytes = *input_bytes;
+	}
+
+	// End to end through the public API
+	{
+		StageTimer t;
+		ok = tzst::archive_tar_zst(opt, archive_path, src) && ok;
+		t.stop(&archive_e2e);
+		archive_e2e.bytes = *input_bytes;
+	}
+	struct stat st;
+	*archive_bytes = stat(archive_path.c_str(), &st) == 0 ? st.st_size : 0;
+	{
+		remove_tree(extract_dir);
+		misc::mkdirs(extract_dir);
+		StageTimer t;
+		ok = tzst::extract_tar_zst(opt, archive_path, extract_dir) && ok;
+		t.stop(&extract_e2e);
+		extract_e2e.bytes = *input_bytes;
+	}
+	remove_tree(extract_dir);
+	remove(archive_path.c_str());
+
+	*stages = { scan, framing, compress, output, decompress, extract, archive_e2e, extract_e2e };
+	return ok;
+}
+
+/**
+ * @brief Throughput in MB/s, or 0 if not applicable
+ */
+double mbps(Stage const &s)
+{
+	return s.bytes > 0 && s.wall_ms > 0 ? s.bytes / (s.wall_ms * 1000.0) : 0;
+}
+
+} // namespace
+
+/**
+ * @brief Benchmark suite over synthetic corpora
+ *
+ * Usage: tzst_bench [--full] [--dir=DIR] [--json=FILE] [-jN] [--verbose] [corpus...]
+ *
+ * Corpora are generated reproducibly under DIR (kept for later runs), each
+ * stage is timed separately and the results are written as JSON.
+ */
+int main(int argc, char **argv)
+{
+	bool full = false;
+	std::string dir = "/tmp/tzst-bench";
+	std::string json_path = "bench_results.json";
+	std::vector<std::string> only;
+	tzst::Option opt;
+	for (int i = 1; i < argc; i++) {
+		char const *p = argv[i];
+		if (strcmp(p, "--full") == 0) {
+			full = true;
+		} else if (strcmp(p, "--verbose") == 0) {
+			opt.verbose = true;
+		} else if (strncmp(p, "--dir=", 6) == 0) {
+			dir = p + 6;
+		} else if (strncmp(p, "--json=", 7) == 0) {
+			json_path = p + 7;
+		} else if (p[0] == '-' && p[1] == 'j') {
+			int n = atoi(p + 2);
+			opt.zsopt.nbworkers = n > 0 ? n : -1;
+		} else if (p[0] == '-') {
+			fprintf(stderr, "unknown option: %s\n", p);
+			return 1;
+		} else {
+			only.push_back(p);
+		}
+	}
+
+	CorpusSpec const *specs = full ? FULL : QUICK;
+	const int nspecs = full ? (int)(sizeof(FULL) / sizeof(*FULL)) : (int)(sizeof(QUICK) / sizeof(*QUICK));
+	if (!misc::mkdirs(dir / "work")) {
+		fprintf(stderr, "error: could not create directory: %s\n", dir.c_str());
+		return 1;
+	}
+
+	FILE *json = fopen(json_path.c_str(), "w");
+	if (!json) {
+		fprintf(stderr, "error: could not create file: %s\n", json_path.c_str());
+		return 1;
+	}
+	fprintf(json, "{\n  \"timestamp\": %lld,\n  \"scale\": \"%s\",\n  \"nbworkers\": %d,\n  \"corpora\": [", (long long)time(nullptr), full ? "full" : "quick", opt.zsopt.nbworkers);
+
+	bool ok = true;
+	bool first = true;
+	for (int i = 0; i < nspecs; i++) {
+		CorpusSpec const &spec = specs[i];
+		if (!only.empty() && std::find(only.begin(), only.end(), spec.name) == only.end()) continue;
+
+		std::string src = dir / (std::string(full ? "full-" : "quick-") + spec.name);
+		if (!generate(spec, src)) {
+			ok = false;
+			break;
+		}
+		std::vector<Stage> stages;
+		uint64_t files = 0;
+		uint64_t input_bytes = 0;
+		uint64_t archive_bytes = 0;
+		if (!run_corpus(opt, src, dir / "work", &stages, &files, &input_bytes, &archive_bytes)) {
+			fprintf(stderr, "error: benchmark failed: %s\n", spec.name);
+			ok = false;
+		}
+
+		printf("%s: %s (%llu files, %.1f MB -> %.1f MB)\n", spec.name, spec.description, (unsigned long long)files, input_bytes / 1e6, archive_bytes / 1e6);
+		for (Stage const &s : stages) {
+			printf("  %-12s %10.1f ms %10.1f ms cpu %10.1f MB/s\n", s.name, s.wall_ms, s.cpu_ms, mbps(s));
+		}
+		fflush(stdout);
+
+		fprintf(json, "%s\n    {\n      \"name\": \"%s\",\n      \"files\": %llu,\n      \"input_bytes\": %llu,\n      \"archive_bytes\": %llu,\n      \"stages\": {", first ? "" : ",", spec.name, (unsigned long long)files, (unsigned long long)input_bytes, (unsigned long long)archive_bytes);
+		for (size_t j = 0; j < stages.size(); j++) {
+			Stage const &s = stages[j];
+			fprintf(json, "%s\n        \"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"bytes\": %llu, \"mb_per_s\": %.1f }", j ? "," : "", s.name, s.wall_ms, s.cpu_ms, (unsigned long long)s.bytes, mbps(s));
+		}
+		fprintf(json, "\n      }\n    }");
+		first = false;
+	}
+	fprintf(json, "\n  ]\n}\n");
+	fclose(json);
+	return ok ? 0 : 1;
+}
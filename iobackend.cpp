@@ -0,0 +1,405 @@
+#include "iobackend.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#define O_BINARY (0)
+#endif
+
+#ifndef POSIX_FADV_DONTNEED
+// No page cache hints on this platform
+#define POSIX_FADV_DONTNEED 0
+#define posix_fadvise(fd, offset, len, advice) (0)
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define USE_IO_URING
+#endif
+#endif
+#endif
+
+namespace {
+
+/**
+ * @brief Blocking backend: one open, read or write, and close call per file
+ */
+class SyncBackend : public io::Backend {
+public:
+	char const *name() const override
+	{
+		return "sync";
+	}
+	/**
+	 * @brief Read files, each up to the length of its operation
+	 * @param ops Operations; result is the number of bytes read or -errno
+	 * @param count Number of operations
+	 */
+	void read_files(io::FileOp *ops, size_t count) override
+	{
+		for (size_t i = 0; i < count; i++) {
+			io::FileOp &op = ops[i];
+			op.result = 0;
+			int fd;
+			do {
+				fd = ::open(op.path, O_RDONLY | O_BINARY);
+			} while (fd == -1 && errno == EINTR);
+			op.opened = fd != -1;
+			if (!op.opened) {
+				op.result = -errno;
+				continue;
+			}
+			size_t pos = 0;
+			while (pos < op.len) {
+				auto n = ::read(fd, op.data + pos, (unsigned)std::min(op.len - pos, (size_t)INT_MAX));
+				if (n < 0 && errno == EINTR) continue;
+				if (n < 0) {
+					pos = 0;
+					op.result = -errno;
+					break;
+				}
+				if (n == 0) break;
+				pos += n;
+			}
+			if (op.result == 0) {
+				op.result = (int64_t)pos;
+			}
+			if (op.drop_cache) {
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			}
+			::close(fd);
+		}
+	}
+	/**
+	 * @brief Create or truncate files and write their contents
+	 * @param ops Operations; result is the number of bytes written or -errno
+	 * @param count Number of operations
+	 */
+	void write_files(io::FileOp *ops, size_t count) override
+	{
+		for (size_t i = 0; i < count; i++) {
+			io::FileOp &op = ops[i];
+			op.result = 0;
+			int fd;
+			do {
+				fd = ::open(op.path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, op.mode);
+			} while (fd == -1 && errno == EINTR);
+			op.opened = fd != -1;
+			if (!op.opened) {
+				op.result = -errno;
+				continue;
+			}
+			size_t pos = 0;
+			while (pos < op.len) {
+				auto n = ::write(fd, op.data + pos, (unsigned)std::min(op.len - pos, (size_t)INT_MAX));
+				if (n < 0 && errno == EINTR) continue;
+				if (n < 1) {
+					op.result = n < 0 ? -errno : -EIO;
+					break;
+				}
+				pos += n;
+			}
+			if (::close(fd) != 0 && op.result == 0) {
+				op.result = -errno;
+			}
+			if (op.result == 0) {
+				op.result = (int64_t)pos;
+			}
+		}
+	}
+};
+
+#ifdef USE_IO_URING
+
+/**
+ * @brief io_uring backend, using the system calls directly
+ *
+ * Files are processed in batches of up to ENTRIES: the opens of a batch
+ * are submitted together, then the reads or writes, then the closes, so
+ * a batch costs three io_uring_enter() calls instead of three or more
+ * system calls per file. Page cache hints are linked to the closes.
+ */
+class UringBackend : public io::Backend {
+private:
+	static constexpr unsigned ENTRIES = 64;
+	static constexpr size_t MAX_TRANSFER = 1 << 30;
+	int fd_ = -1;
+	void *sq_ring_ = MAP_FAILED;
+	void *cq_ring_ = MAP_FAILED;
+	size_t sq_ring_size_ = 0;
+	size_t cq_ring_size_ = 0;
+	io_uring_sqe *sqes_ = (io_uring_sqe *)MAP_FAILED;
+	size_t sqes_size_ = 0;
+	unsigned *sq_tail_ = nullptr;
+	unsigned *sq_mask_ = nullptr;
+	unsigned *sq_array_ = nullptr;
+	unsigned *cq_head_ = nullptr;
+	unsigned *cq_tail_ = nullptr;
+	unsigned *cq_mask_ = nullptr;
+	io_uring_cqe *cqes_ = nullptr;
+	unsigned queued_ = 0;
+	bool fadvise_ = false; // IORING_OP_FADVISE is supported
+
+	/**
+	 * @brief Get a cleared submission queue entry
+	 */
+	io_uring_sqe *get_sqe(uint8_t opcode, uint64_t user_data)
+	{
+		unsigned tail = *sq_tail_ + queued_;
+		unsigned index = tail & *sq_mask_;
+		io_uring_sqe *sqe = &sqes_[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->user_data = user_data;
+		sq_array_[index] = index;
+		queued_++;
+		return sqe;
+	}
+	/**
+	 * @brief Submit the queued entries and wait for all of their completions
+	 *
+	 * Interrupted waits are resumed, and a full completion queue is
+	 * drained before the next attempt. If the ring fails, the completions
+	 * that did arrive are still passed to fn, so that opened files can be
+	 * closed.
+	 * @param fn Called with the user data and result of each completion
+	 * @return false if the ring failed; the entries without completion are then lost
+	 */
+	template <typename F> bool submit(F const &fn)
+	{
+		const unsigned count = queued_;
+		__atomic_store_n(sq_tail_, *sq_tail_ + count, __ATOMIC_RELEASE);
+		queued_ = 0;
+		unsigned to_submit = count;
+		unsigned done = 0;
+		auto reap = [&](){
+			unsigned head = *cq_head_;
+			unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+			while (head != tail) {
+				io_uring_cqe const &cqe = cqes_[head & *cq_mask_];
+				fn(cqe.user_data, cqe.res);
+				head++;
+				done++;
+			}
+			__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+		};
+		while (done < count) {
+			long r = syscall(__NR_io_uring_enter, fd_, to_submit, count - done, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (r < 0) {
+				const int err = errno;
+				if (err == EINTR) continue;
+				reap();
+				if (err == EAGAIN || err == EBUSY) continue;
+				return false;
+			}
+			to_submit -= std::min(to_submit, (unsigned)r);
+			reap();
+		}
+		return true;
+	}
+	/**
+	 * @brief Open, transfer and close the files of one batch
+	 * @param ops Operations
+	 * @param count Number of operations, at most ENTRIES
+	 * @param write true to write the files, false to read them
+	 */
+	void run_batch(io::FileOp *ops, size_t count, bool write)
+	{
+		int fds[ENTRIES];
+		size_t pos[ENTRIES];
+		size_t end[ENTRIES];
+		for (size_t i = 0; i < count; i++) {
+			io::FileOp &op = ops[i];
+			io_uring_sqe *sqe = get_sqe(IORING_OP_OPENAT, i);
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)op.path;
+			sqe->open_flags = write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+			sqe->len = write ? op.mode : 0;
+			fds[i] = -1;
+			pos[i] = 0;
+			end[i] = op.len;
+			op.opened = false;
+			op.result = -EIO;
+		}
+		bool ok = submit([&](uint64_t i, int res){
+			if (res >= 0) {
+				fds[i] = res;
+				ops[i].opened = true;
+				ops[i].result = 0;
+			} else {
+				ops[i].result = res;
+			}
+		});
+
+		// Transfer until every file is complete; short transfers are resubmitted
+		while (ok) {
+			for (size_t i = 0; i < count; i++) {
+				io::FileOp &op = ops[i];
+				if (fds[i] == -1 || op.result != 0 || pos[i] == end[i]) continue;
+				io_uring_sqe *sqe = get_sqe(write ? IORING_OP_WRITE : IORING_OP_READ, i);
+				sqe->fd = fds[i];
+				sqe->addr = (uintptr_t)(op.data + pos[i]);
+				sqe->len = (unsigned)std::min(end[i] - pos[i], MAX_TRANSFER);
+				sqe->off = pos[i];
+			}
+			if (queued_ == 0) break;
+			ok = submit([&](uint64_t i, int res){
+				if (res > 0) {
+					pos[i] += res;
+				} else if (res < 0) {
+					ops[i].result = res;
+				} else if (write) {
+					ops[i].result = -EIO;
+				} else {
+					end[i] = pos[i]; // end of file
+				}
+			});
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			if (fds[i] == -1) continue;
+			if (ok) {
+				if (ops[i].drop_cache && fadvise_) {
+					// A hard link keeps the close even if the hint fails
+					io_uring_sqe *sqe = get_sqe(IORING_OP_FADVISE, i);
+					sqe->fd = fds[i];
+					sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+					sqe->flags = IOSQE_IO_HARDLINK;
+				}
+				get_sqe(IORING_OP_CLOSE, i)->fd = fds[i];
+			} else {
+				::close(fds[i]);
+				ops[i].result = -EIO;
+			}
+		}
+		if (ok) {
+			submit([&](uint64_t i, int res){
+				if (res < 0 && write && ops[i].result == 0) {
+					ops[i].result = res;
+				}
+			});
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (ops[i].result == 0) {
+				ops[i].result = (int64_t)pos[i];
+			}
+		}
+	}
+public:
+	~UringBackend() override
+	{
+		if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+		if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+		if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+		if (fd_ != -1) ::close(fd_);
+	}
+	/**
+	 * @brief Set up the ring and check that the kernel supports the operations used
+	 * @return false if io_uring is not available
+	 */
+	bool init()
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		// A batch queues up to two entries per file (hint and close)
+		fd_ = (int)syscall(__NR_io_uring_setup, 2 * ENTRIES, &p);
+		if (fd_ < 0) {
+			fd_ = -1;
+			return false;
+		}
+
+		// Opcodes that the kernel does not know are reported as unsupported
+		std::vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+		io_uring_probe *probe = (io_uring_probe *)buf.data();
+		if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+		for (uint8_t op : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+		}
+		fadvise_ = IORING_OP_FADVISE <= probe->last_op && (probe->ops[IORING_OP_FADVISE].flags & IO_URING_OP_SUPPORTED);
+
+		sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single) {
+			sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+		}
+		sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		if (sq_ring_ == MAP_FAILED) return false;
+		cq_ring_ = single ? sq_ring_ : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cq_ring_ == MAP_FAILED) return false;
+		sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = (io_uring_sqe *)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+		if (sqes_ == MAP_FAILED) return false;
+
+		char *sq = (char *)sq_ring_;
+		char *cq = (char *)cq_ring_;
+		sq_tail_ = (unsigned *)(sq + p.sq_off.tail);
+		sq_mask_ = (unsigned *)(sq + p.sq_off.ring_mask);
+		sq_array_ = (unsigned *)(sq + p.sq_off.array);
+		cq_head_ = (unsigned *)(cq + p.cq_off.head);
+		cq_tail_ = (unsigned *)(cq + p.cq_off.tail);
+		cq_mask_ = (unsigned *)(cq + p.cq_off.ring_mask);
+		cqes_ = (io_uring_cqe *)(cq + p.cq_off.cqes);
+		return true;
+	}
+	char const *name() const override
+	{
+		return "io_uring";
+	}
+	void read_files(io::FileOp *ops, size_t count) override
+	{
+		for (size_t i = 0; i < count; i += ENTRIES) {
+			run_batch(ops + i, std::min(count - i, (size_t)ENTRIES), false);
+		}
+	}
+	void write_files(io::FileOp *ops, size_t count) override
+	{
+		for (size_t i = 0; i < count; i += ENTRIES) {
+			run_batch(ops + i, std::min(count - i, (size_t)ENTRIES), true);
+		}
+	}
+};
+
+#endif
+
+} // namespace
+
+/**
+ * @brief Create an I/O backend
+ *
+ * io_uring may be missing from the kernel, disabled by the administrator or
+ * blocked by a seccomp filter; the blocking backend is returned then.
+ * @param type Backend to create
+ * @return The backend (never nullptr)
+ */
+std::unique_ptr<io::Backend> io::Backend::create(Type type)
+{
+#ifdef USE_IO_URING
+	if (type != Sync) {
+		auto uring = std::make_unique<UringBackend>();
+		if (uring->init()) return uring;
+	}
+#endif
+	(void)type;
+	return std::make_unique<SyncBackend>();
+}
+
+/**
+ * @brief Check whether the io_uring backend can be used
+ * @return true if an io_uring backend can be created
+ */
+bool io::Backend::uring_available()
+{
+	return strcmp(create(Uring)->name(), "io_uring") == 0;
+}
@@ -0,0 +1,45 @@
+#ifndef IOBACKEND_H
+#define IOBACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace io {
+
+/**
+ * @brief Whole-file read or write handled by a Backend
+ */
+struct FileOp {
+	char const *path = nullptr;
+	char *data = nullptr; // read: destination, write: content
+	size_t len = 0; // bytes to read (at most) or to write
+	int mode = 0; // permissions of a created file
+	bool drop_cache = false; // read: advise the kernel to drop the cached pages once read
+	bool opened = false; // the file could be opened or created
+	int64_t result = 0; // bytes transferred, or -errno
+};
+
+/**
+ * @brief Batched file I/O: opens, transfers and closes many small files at once
+ *
+ * A backend is not thread-safe; each thread creates its own.
+ */
+class Backend {
+public:
+	enum Type {
+		Auto, // io_uring where available, blocking calls otherwise
+		Sync, // blocking open/read/write/close
+		Uring, // io_uring (Linux), blocking calls if unavailable
+	};
+	virtual ~Backend() = default;
+	virtual char const *name() const = 0;
+	virtual void read_files(FileOp *ops, size_t count) = 0;
+	virtual void write_files(FileOp *ops, size_t count) = 0;
+	static std::unique_ptr<Backend> create(Type type);
+	static bool uring_available();
+};
+
+}
+
+#endif // IOBACKEND_H
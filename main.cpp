@@ -1,8 +1,10 @@
 #include "base64.h"
+#include "stats.h"
 #include "tar.h"
 #include "tzst.h"
 #include "zs.h"
-#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 #include <string>
 #include <sys/stat.h>
@@ -13,32 +15,45 @@
 #include <unistd.h>
 #endif
 
-class ElapsedTimer {
-private:
-	using time_point = std::chrono::system_clock::time_point;
-	time_point tp_start_;
-	time_point now() const
-	{
-		return std::chrono::system_clock::now();
+static const uint64_t DEFAULT_FRAME_SIZE = 4 << 20;
+static const size_t DEFAULT_DICT_SIZE = 112640;
+
+/**
+ * @brief Parse a size with an optional K, M or G suffix
+ * @param s Size string
+ * @return Size in bytes (0 if invalid)
+ */
+static uint64_t parse_size(char const *s)
+{
+	char *end = nullptr;
+	uint64_t n = strtoull(s, &end, 10);
+	if (end == s) return 0;
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; end++; break;
+	case 'm': case 'M': n <<= 20; end++; break;
+	case 'g': case 'G': n <<= 30; end++; break;
 	}
-public:
-	/**
-	 * @brief Start the timer
-	 */
-	void start()
-	{
-		tp_start_ = now();
+	if (*end != 0) return 0;
+	return n;
+}
+
+/**
+ * @brief Print a progress line to stderr, overwriting the previous one
+ * @param p Progress
+ */
+static void print_progress(tzst::Progress const &p)
+{
+	// The final line shows the average throughput
+	const double rate = p.done ? (p.elapsed > 0 ? p.bytes / p.elapsed : 0) : p.bytes_per_sec;
+	if (p.files_total > 0) {
+		fprintf(stderr, "\r%llu/%llu files, %.1f/%.1f MB, %.1f MB/s  ", (unsigned long long)p.files, (unsigned long long)p.files_total, p.bytes / 1e6, p.bytes_total / 1e6, rate / 1e6);
+	} else {
+		fprintf(stderr, "\r%llu files, %.1f MB, %.1f MB/s  ", (unsigned long long)p.files, p.bytes / 1e6, rate / 1e6);
 	}
-	/**
-	 * @brief Get elapsed time in milliseconds
-	 * @return Elapsed time since start() was called
-	 */
-	int64_t elapsed() const
-	{
-		time_point tp = now();
-		return (std::chrono::duration_cast<std::chrono::milliseconds>(tp - tp_start_)).count();
+	if (p.done) {
+		fputc('\n', stderr);
 	}
-};
+}
 
 /**
  * @brief Main entry point for tar.zst compression/decompression tool
@@ -57,7 +72,9 @@ int main(int argc, char **argv)
 		None,
 		Compress,
 		Decompress,
+		List,
 	} command = None;
+	bool verbose = false;
 
 	// Parse command option from first argument
 	{
@@ -85,6 +102,18 @@ int main(int argc, char **argv)
 					fprintf(stderr, "conflict command: %c\n", *p);
 				}
 				break;
+			case 't':
+				// Set list command
+				if (command == None) {
+					command = List;
+				} else {
+					fprintf(stderr, "conflict command: %c\n", *p);
+				}
+				break;
+			case 'v':
+				// Print every file
+				verbose = true;
+				break;
 			default:
 				fprintf(stderr, "unknown command: %c\n", *p);
 				return 1;
@@ -99,42 +128,144 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	// Get archive file path from second argument
-	std::string tarzst_path = argv[2];
+	tzst::Option opt;
+	opt.verbose = verbose;
+	enum StatsFormat {
+		NoStats,
+		StatsText,
+		StatsJson,
+	} stats_format = NoStats;
 
-	// Collect remaining arguments as file list
-	std::vector<std::string> files;
-	int i = 3;
+	// Collect remaining arguments as archive path and file list
+	std::vector<std::string> args;
+	int i = 2;
 	while (i < argc) {
 		char const *p = argv[i];
-		if (command == Compress) {
-			// Add files to compress
-			files.push_back(p);
+		if (p[0] == '-' && p[1] == 'j') {
+			// Number of compression worker threads (0: one per core)
+			p += 2;
+			if (*p == 0) {
+				if (i + 1 >= argc) {
+					fprintf(stderr, "missing argument: -j\n");
+					return 1;
+				}
+				p = argv[++i];
+			}
+			int n = atoi(p);
+			opt.zsopt.nbworkers = n > 0 ? n : -1;
+		} else if (strcmp(p, "--seekable") == 0) {
+			// Independent frames with a seek table
+			opt.zsopt.frame_size = DEFAULT_FRAME_SIZE;
+		} else if (strncmp(p, "--frame-size=", 13) == 0) {
+			opt.zsopt.frame_size = parse_size(p + 13);
+			if (opt.zsopt.frame_size == 0) {
+				fprintf(stderr, "invalid frame size: %s\n", p + 13);
+				return 1;
+			}
+		} else if (strcmp(p, "--no-store") == 0) {
+			// Compress everything, even data that looks incompressible
+			opt.store_incompressible = false;
+		} else if (strcmp(p, "--dedup") == 0) {
+			// Store identical files once
+			opt.dedup = true;
+		} else if (strncmp(p, "--io=", 5) == 0) {
+			// I/O backend for small files
+			if (strcmp(p + 5, "auto") == 0) {
+				opt.io_backend = io::Backend::Auto;
+			} else if (strcmp(p + 5, "sync") == 0) {
+				opt.io_backend = io::Backend::Sync;
+			} else if (strcmp(p + 5, "uring") == 0) {
+				opt.io_backend = io::Backend::Uring;
+				if (!io::Backend::uring_available()) {
+					fprintf(stderr, "warning: io_uring is not available, using blocking I/O\n");
+				}
+			} else {
+				fprintf(stderr, "invalid I/O backend: %s\n", p + 5);
+				return 1;
+			}
+		} else if (strcmp(p, "--drop-cache") == 0) {
+			// Leave the page cache to other programs
+			opt.drop_cache = true;
+		} else if (strcmp(p, "--readahead") == 0) {
+			opt.readahead = true;
+		} else if (strcmp(p, "--direct") == 0) {
+			opt.direct_output = true;
+		} else if (strcmp(p, "--dict") == 0 || strncmp(p, "--dict=", 7) == 0) {
+			// Train a dictionary for archives of many small files
+			opt.dict_size = p[6] ? (size_t)parse_size(p + 7) : DEFAULT_DICT_SIZE;
+			if (opt.dict_size == 0) {
+				fprintf(stderr, "invalid dictionary size: %s\n", p + 7);
+				return 1;
+			}
+		} else if (strcmp(p, "--stats") == 0 || strcmp(p, "--stats=text") == 0) {
+			// Report per-stage counters and timers at the end
+			stats_format = StatsText;
+		} else if (strcmp(p, "--stats=json") == 0) {
+			stats_format = StatsJson;
+		} else if (strncmp(p, "--snapshot=", 11) == 0) {
+			// Incremental archive against a manifest of the previous one
+			opt.snapshot = p + 11;
+		} else if (strcmp(p, "--snapshot-hash") == 0) {
+			opt.snapshot_hash = true;
+		} else if (strcmp(p, "--progress") == 0) {
+			// Show files and bytes done and the throughput
+			opt.progress = print_progress;
 		} else {
-			// Decompress doesn't take additional file arguments
-			fprintf(stderr, "extra argument: %s\n", p);
-			return 1;
+			args.push_back(p);
 		}
 		i++;
 	}
+	if (args.empty()) {
+		fprintf(stderr, "no archive file specified\n");
+		return 1;
+	}
+
+	// Get archive file path from the first argument
+	std::string tarzst_path = args[0];
+
+	std::vector<std::string> files;
+	for (size_t j = 1; j < args.size(); j++) {
+		if (command == Compress || command == Decompress) {
+			// Add files to compress, or members to extract
+			files.push_back(args[j]);
+		} else {
+			// List doesn't take additional file arguments
+			fprintf(stderr, "extra argument: %s\n", args[j].c_str());
+			return 1;
+		}
+	}
+
+	Stats stats;
+	if (stats_format != NoStats) {
+		opt.stats = &stats;
+	}
 
 	// Execute compression or decompression
-	ElapsedTimer t;
-	t.start();
-	tzst::Option opt;
+	bool ok = false;
 	if (command == Compress) {
 		// Perform compression
 		if (files.empty()) {
 			fprintf(stderr, "no file specified\n");
 			return 1;
 		}
-		tzst::archive_tar_zst(opt, tarzst_path, files[0]);
+		ok = tzst::archive_tar_zst(opt, tarzst_path, files[0]);
 	} else if (command == Decompress) {
-		// Perform decompression/extraction
-		tzst::extract_tar_zst(opt, tarzst_path);
+		// Perform decompression/extraction, of the given members only if any
+		ok = tzst::extract_tar_zst(opt, tarzst_path, {}, files);
+	} else if (command == List) {
+		// List archive contents
+		std::vector<tzst::Entry> entries;
+		ok = tzst::list_tar_zst(opt, tarzst_path, &entries);
+		for (tzst::Entry const &e : entries) {
+			printf("%12llu %s\n", (unsigned long long)e.size, e.path.c_str());
+		}
+	}
+
+	if (stats_format != NoStats) {
+		stats.finish();
+		std::string s = stats_format == StatsJson ? stats.json() : stats.text();
+		fputs(s.c_str(), stderr);
 	}
-	// Print elapsed time in milliseconds
-	// fprintf(stderr, "%d\n", (int)t.elapsed());
 
-	return 0;
+	return ok ? 0 : 1;
 }
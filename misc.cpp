@@ -1,15 +1,25 @@
 #include "misc.h"
 #include "joinpath.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 
 #ifdef _WIN32
 #include <direct.h>
 #include <io.h>
 #define MKDIR(D) _mkdir(D)
+#define RMDIR(D) _rmdir(D)
 #else
 #include <unistd.h>
 #define MKDIR(D) ::mkdir(D, 0755)
+#define RMDIR(D) ::rmdir(D)
 #define O_BINARY (0)
 #endif
 
@@ -23,6 +33,67 @@ int misc::mkdir(char const *dir)
 	return MKDIR(dir);
 }
 
+/**
+ * @brief Remove an empty directory
+ * @param dir Directory path to remove
+ * @return 0 on success, -1 on failure
+ */
+int misc::rmdir(char const *dir)
+{
+	return RMDIR(dir);
+}
+
+
+/**
+ * @brief Write the whole buffer to a file descriptor
+ *
+ * Writes interrupted by a signal are retried.
+ * @param fd File descriptor
+ * @param ptr Pointer to data
+ * @param len Length of data
+ * @return true if all bytes were written, false otherwise
+ */
+bool misc::write_fully(int fd, char const *ptr, size_t len)
+{
+	while (len > 0) {
+		auto n = ::write(fd, ptr, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 1) return false;
+		ptr += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * @brief Read exactly len bytes at the given file offset
+ *
+ * Reads interrupted by a signal are retried.
+ * @param fd File descriptor
+ * @param ptr Output buffer
+ * @param len Number of bytes to read
+ * @param offset File offset
+ * @return true if all bytes were read, false otherwise
+ */
+bool misc::pread_fully(int fd, char *ptr, size_t len, uint64_t offset)
+{
+#ifdef _WIN32
+	if (_lseeki64(fd, offset, SEEK_SET) < 0) return false;
+#endif
+	while (len > 0) {
+#ifdef _WIN32
+		auto n = ::_read(fd, ptr, (unsigned int)std::min(len, (size_t)INT_MAX));
+#else
+		auto n = ::pread(fd, ptr, len, offset);
+#endif
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 1) return false;
+		ptr += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
 
 #ifdef _WIN32
 #include <windows.h>
@@ -173,6 +244,8 @@ bool misc::isdir(const std::string &path)
 	return true;
 }
 
+#ifdef _WIN32
+
 /**
  * @brief Recursively scan directory for files
  * @param dir Directory path to scan
@@ -199,8 +272,285 @@ void misc::scan_files(const std::string &dir, const std::string &prefix, std::ve
 			} else {
 				// Add regular files to output
 				item.size = st.st_size;
+				item.mtime = (int64_t)st.st_mtime * 1000000000;
+				item.ino = st.st_ino;
+				item.dev = st.st_dev;
+				item.nlink = st.st_nlink;
 				out->push_back(item);
 			}
 		}
 	}
 }
+
+#else // _WIN32
+
+namespace {
+
+/**
+ * @brief Directory scanned by the parallel scanner
+ */
+struct ScanNode {
+	struct Entry {
+		std::string name;
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		uint64_t ino = 0;
+		uint64_t dev = 0;
+		uint32_t nlink = 1;
+		std::unique_ptr<ScanNode> dir; // non-null for subdirectories
+	};
+	std::string source_path;
+	std::string target_path;
+	std::vector<Entry> entries; // sorted by name
+	ScanNode const *parent = nullptr;
+	uint64_t ino = 0;
+	uint64_t dev = 0;
+	/**
+	 * @brief Check whether a directory is this one or one of its parents
+	 */
+	bool is_ancestor(uint64_t dev, uint64_t ino) const
+	{
+		for (ScanNode const *n = this; n; n = n->parent) {
+			if (n->dev == dev && n->ino == ino) return true;
+		}
+		return false;
+	}
+};
+
+/**
+ * @brief Parallel directory scanner
+ *
+ * Directories are processed by a pool of threads sharing one work queue.
+ * Each directory is read through its own descriptor; entries are examined
+ * with fstatat/statx relative to it, and d_type is used to avoid stat()
+ * calls on subdirectories. Results are collected per directory and
+ * flattened in name order, so the output does not depend on scheduling.
+ */
+class ParallelScanner {
+private:
+	struct Task {
+		ScanNode *node;
+		int fd; // -1: open by path
+	};
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::vector<Task> queue_;
+	int active_ = 0;
+	int open_fds_ = 0;
+	static constexpr int MAX_OPEN_FDS = 256;
+
+	/**
+	 * @brief Get type and metadata of an entry relative to a directory descriptor
+	 * @param dfd Directory descriptor
+	 * @param name Entry name
+	 * @param isdir Set to true if the entry is a directory
+	 * @param e Set size, mtime, inode, device and link count of regular files
+	 * @return false if the entry is neither a regular file nor a directory
+	 */
+	static bool stat_entry(int dfd, char const *name, bool *isdir, ScanNode::Entry *e)
+	{
+#ifdef STATX_SIZE
+		struct statx stx;
+		if (statx(dfd, name, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO | STATX_NLINK, &stx) != 0) return false;
+		*isdir = S_ISDIR(stx.stx_mode);
+		e->size = stx.stx_size;
+		e->mtime = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+		e->ino = stx.stx_ino;
+		e->dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+		e->nlink = stx.stx_nlink;
+		return *isdir || S_ISREG(stx.stx_mode);
+#else
+		struct stat st;
+		if (fstatat(dfd, name, &st, 0) != 0) return false;
+		*isdir = S_ISDIR(st.st_mode);
+		e->size = st.st_size;
+		e->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		e->ino = st.st_ino;
+		e->dev = st.st_dev;
+		e->nlink = st.st_nlink;
+		return *isdir || S_ISREG(st.st_mode);
+#endif
+	}
+
+	/**
+	 * @brief Read one directory and queue its subdirectories
+	 * @param task Directory to process
+	 */
+	void process(Task task)
+	{
+		ScanNode *node = task.node;
+		int dfd = task.fd;
+		if (dfd == -1) {
+			dfd = open(node->source_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		if (dfd == -1) return;
+		// Identity of the directory, which links in its subtree may refer to
+		bool self_dir;
+		ScanNode::Entry self;
+		if (stat_entry(dfd, ".", &self_dir, &self)) {
+			node->dev = self.dev;
+			node->ino = self.ino;
+		}
+		DIR *dir = fdopendir(dfd);
+		if (!dir) {
+			close(dfd);
+			return;
+		}
+
+		std::vector<Task> children;
+		while (dirent *d = readdir(dir)) {
+			char const *name = d->d_name;
+			if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+			bool isdir = false;
+			ScanNode::Entry e;
+			if (d->d_type == DT_DIR) {
+				isdir = true;
+			} else if (d->d_type == DT_REG || d->d_type == DT_LNK || d->d_type == DT_UNKNOWN) {
+				// Symbolic links are followed like stat() does, except to the
+				// directories they are in, which would be scanned forever
+				if (!stat_entry(dfd, name, &isdir, &e)) continue;
+				if (isdir && node->is_ancestor(e.dev, e.ino)) continue;
+			} else {
+				continue; // devices, FIFOs and sockets are not archived
+			}
+			e.name = name;
+			if (isdir) {
+				e.dir.reset(new ScanNode);
+				e.dir->parent = node;
+				e.dir->source_path = node->source_path / e.name;
+				e.dir->target_path = node->target_path.empty() ? e.name : (node->target_path / e.name);
+			}
+			node->entries.push_back(std::move(e));
+		}
+
+		std::sort(node->entries.begin(), node->entries.end(), [](ScanNode::Entry const &a, ScanNode::Entry const &b){
+			return a.name < b.name;
+		});
+
+		// Open subdirectories relative to this one while descriptors are available
+		for (ScanNode::Entry &e : node->entries) {
+			if (!e.dir) continue;
+			int fd = -1;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (open_fds_ < MAX_OPEN_FDS) {
+					open_fds_++;
+				} else {
+					fd = -2;
+				}
+			}
+			if (fd == -1) {
+				fd = openat(dfd, e.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				if (fd == -1) {
+					std::lock_guard<std::mutex> lock(mutex_);
+					open_fds_--;
+				}
+			} else {
+				fd = -1;
+			}
+			children.push_back({e.dir.get(), fd});
+		}
+		closedir(dir);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto it = children.rbegin(); it != children.rend(); it++) {
+			queue_.push_back(*it);
+		}
+		cond_.notify_all();
+	}
+
+	/**
+	 * @brief Process queued directories until all work is done (runs in worker threads)
+	 */
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (1) {
+			cond_.wait(lock, [&](){ return !queue_.empty() || active_ == 0; });
+			if (queue_.empty()) break;
+			// Take the most recently queued directory (depth first)
+			Task task = queue_.back();
+			queue_.pop_back();
+			if (task.fd != -1) {
+				open_fds_--;
+			}
+			active_++;
+			lock.unlock();
+			process(task);
+			lock.lock();
+			active_--;
+			cond_.notify_all();
+		}
+	}
+
+	/**
+	 * @brief Append the files of a scanned tree to the output in name order
+	 */
+	static void flatten(ScanNode const &node, std::vector<misc::FileItem> *out)
+	{
+		for (ScanNode::Entry const &e : node.entries) {
+			if (e.dir) {
+				flatten(*e.dir, out);
+			} else {
+				misc::FileItem item;
+				item.size = e.size;
+				item.mtime = e.mtime;
+				item.ino = e.ino;
+				item.dev = e.dev;
+				item.nlink = e.nlink;
+				item.source_path = node.source_path / e.name;
+				item.target_path = node.target_path.empty() ? e.name : (node.target_path / e.name);
+				out->push_back(std::move(item));
+			}
+		}
+	}
+public:
+	/**
+	 * @brief Scan a directory tree
+	 * @param dir Directory path to scan
+	 * @param prefix Prefix to add to target paths
+	 * @param out Output vector to store file items
+	 */
+	void scan(std::string const &dir, std::string const &prefix, std::vector<misc::FileItem> *out)
+	{
+		ScanNode root;
+		root.source_path = dir;
+		root.target_path = prefix;
+		queue_.push_back({&root, -1});
+		active_ = 0;
+
+		// Scanning is latency bound on network file systems, so use at least a few threads
+		const int nthreads = std::min(std::max((int)std::thread::hardware_concurrency(), 4), 32);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < nthreads; i++) {
+			threads.emplace_back([this](){
+				run();
+			});
+		}
+		for (std::thread &th : threads) {
+			th.join();
+		}
+
+		flatten(root, out);
+	}
+};
+
+} // namespace
+
+/**
+ * @brief Recursively scan directory for files
+ *
+ * Regular files (and symbolic links to them) are returned in a
+ * deterministic order: entries of each directory sorted by name, with the
+ * contents of subdirectories in place.
+ * @param dir Directory path to scan
+ * @param prefix Prefix to add to target paths
+ * @param out Output vector to store file items
+ */
+void misc::scan_files(const std::string &dir, const std::string &prefix, std::vector<FileItem> *out)
+{
+	ParallelScanner scanner;
+	scanner.scan(dir, prefix, out);
+}
+
+#endif // _WIN32
@@ -14,6 +14,10 @@ public:
 
 	struct FileItem {
 		uint64_t size = 0;
+		int64_t mtime = 0; // nanoseconds since the epoch
+		uint64_t ino = 0;
+		uint64_t dev = 0;
+		uint32_t nlink = 1;
 		std::string source_path;
 		std::string target_path;
 	};
@@ -21,9 +25,12 @@ public:
 	static void scan_files(const std::string &dir, const std::string &prefix, std::vector<FileItem> *out);
 	static void getdirents(const std::string &loc, std::vector<DirEnt> *out);
 	static int mkdir(char const *dir);
+	static int rmdir(char const *dir);
 	static bool mkdirs(const std::string &dir);
 	static void parsedirs(const std::string &dir, std::vector<std::string> *out);
 	static bool isdir(const std::string &path);
+	static bool write_fully(int fd, char const *ptr, size_t len);
+	static bool pread_fully(int fd, char *ptr, size_t len, uint64_t offset);
 };
 
 #endif // MISC_H
@@ -0,0 +1,127 @@
+#ifndef ORDEREDPOOL_H
+#define ORDEREDPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Worker pool that runs jobs in parallel and returns the results in submission order
+ *
+ * The caller is expected to bound the number of outstanding jobs by popping
+ * results whenever size() reaches its limit.
+ */
+template <typename In, typename Out> class OrderedPool {
+public:
+	using Function = std::function<void (int worker, In &in, Out *out)>;
+private:
+	struct Job {
+		In in;
+		Out out;
+		bool done = false;
+	};
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	Function fn_;
+	std::vector<std::thread> threads_;
+	std::deque<std::unique_ptr<Job>> jobs_; // all outstanding jobs in submission order
+	std::deque<Job *> pending_; // jobs not yet picked up by a worker
+	bool quit_ = false;
+
+	void run(int worker)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (1) {
+			cond_.wait(lock, [&](){ return quit_ || !pending_.empty(); });
+			if (quit_) break;
+			Job *job = pending_.front();
+			pending_.pop_front();
+			lock.unlock();
+			fn_(worker, job->in, &job->out);
+			lock.lock();
+			job->done = true;
+			cond_.notify_all();
+		}
+	}
+public:
+	/**
+	 * @brief Constructor for OrderedPool
+	 * @param nthreads Number of worker threads
+	 * @param fn Job function, called with the worker index, the input and the output
+	 */
+	OrderedPool(int nthreads, Function fn)
+		: fn_(fn)
+	{
+		for (int i = 0; i < nthreads; i++) {
+			threads_.emplace_back([this, i](){
+				run(i);
+			});
+		}
+	}
+	~OrderedPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			quit_ = true;
+			cond_.notify_all();
+		}
+		for (std::thread &th : threads_) {
+			th.join();
+		}
+	}
+	OrderedPool(OrderedPool const &) = delete;
+	OrderedPool &operator = (OrderedPool const &) = delete;
+	/**
+	 * @brief Get the number of worker threads
+	 */
+	int threads() const
+	{
+		return (int)threads_.size();
+	}
+	/**
+	 * @brief Get the number of jobs whose results have not been popped yet
+	 */
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return jobs_.size();
+	}
+	/**
+	 * @brief Submit a job
+	 * @param in Job input
+	 */
+	void push(In &&in)
+	{
+		std::unique_ptr<Job> job(new Job);
+		job->in = std::move(in);
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_.push_back(job.get());
+		jobs_.push_back(std::move(job));
+		cond_.notify_all();
+	}
+	/**
+	 * @brief Take the result of the oldest job
+	 * @param out Output
+	 * @param wait Wait for the oldest job to finish if it is still running
+	 * @return false if there is no job, or it is not finished and wait is false
+	 */
+	bool pop(Out *out, bool wait = true)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (jobs_.empty()) return false;
+		if (wait) {
+			cond_.wait(lock, [&](){ return jobs_.front()->done; });
+		} else if (!jobs_.front()->done) {
+			return false;
+		}
+		*out = std::move(jobs_.front()->out);
+		jobs_.pop_front();
+		return true;
+	}
+};
+
+#endif // ORDEREDPOOL_H
@@ -8,21 +8,30 @@ CONFIG += console c++17 nostrip debug_info
 
 QMAKE_CXXFLAGS += -g
 
-DEFINES += ZSTD_DISABLE_ASM
+DEFINES += ZSTD_DISABLE_ASM ZSTD_MULTITHREAD _FILE_OFFSET_BITS=64
+
+unix:LIBS += -lpthread
 
 SOURCES += \
 	../base64.cpp \
+	../iobackend.cpp \
 	../joinpath.cpp \
 	../main.cpp \
 	../misc.cpp \
+	../snapshot.cpp \
+	../stats.cpp \
 	../tar.cpp \
 	../tzst.cpp \
 	../zs.cpp
 
 HEADERS += \
 	../base64.h \
+	../iobackend.h \
 	../joinpath.h \
 	../misc.h \
+	../orderedpool.h \
+	../snapshot.h \
+	../stats.h \
 	../tar.h \
 	../tzst.h \
 	../zs.h
@@ -65,7 +74,9 @@ HEADERS += \
 	../zstd/lib/compress/zstdmt_compress.h \
 	../zstd/lib/decompress/zstd_ddict.h \
 	../zstd/lib/decompress/zstd_decompress_block.h \
-	../zstd/lib/decompress/zstd_decompress_internal.h
+	../zstd/lib/decompress/zstd_decompress_internal.h \
+	../zstd/lib/dictBuilder/cover.h \
+	../zstd/lib/dictBuilder/divsufsort.h
 
 SOURCES += \
 	../zstd/lib/common/debug.c \
@@ -93,5 +104,9 @@ SOURCES += \
 	../zstd/lib/decompress/huf_decompress.c \
 	../zstd/lib/decompress/zstd_ddict.c \
 	../zstd/lib/decompress/zstd_decompress.c \
-	../zstd/lib/decompress/zstd_decompress_block.c
+	../zstd/lib/decompress/zstd_decompress_block.c \
+	../zstd/lib/dictBuilder/cover.c \
+	../zstd/lib/dictBuilder/divsufsort.c \
+	../zstd/lib/dictBuilder/fastcover.c \
+	../zstd/lib/dictBuilder/zdict.c
 
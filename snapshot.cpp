@@ -0,0 +1,198 @@
+#include "snapshot.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <vector>
+
+#define XXH_STATIC_LINKING_ONLY
+#include <common/xxhash.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#define O_BINARY (0)
+#endif
+
+// The manifest is a text file: a header line, then one line per file with
+// size, mtime (ns), inode number, XXH64 hash in hex ('-' if none) and the
+// path in the archive, separated by single spaces. Backslashes and newlines
+// in paths are escaped as "\\" and "\n".
+static char const SNAPSHOT_HEADER[] = "tzst-snapshot 1\n";
+
+/**
+ * @brief Load a snapshot manifest
+ *
+ * A manifest that does not exist yet loads as an empty snapshot, so that
+ * the first archive of a series contains every file.
+ * @param path Path to the manifest
+ * @return false if the manifest exists but could not be read or parsed
+ */
+bool Snapshot::load(std::string const &path)
+{
+	files.clear();
+	int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) return true;
+		fprintf(stderr, "error: failed to open the snapshot: %s\n", path.c_str());
+		return false;
+	}
+	std::string text;
+	char buf[65536];
+	while (1) {
+		auto n = ::read(fd, buf, sizeof(buf));
+		if (n < 0) {
+			close(fd);
+			fprintf(stderr, "error: failed to read the snapshot: %s\n", path.c_str());
+			return false;
+		}
+		if (n == 0) break;
+		text.append(buf, n);
+	}
+	close(fd);
+
+	const size_t header_len = sizeof(SNAPSHOT_HEADER) - 1;
+	if (text.compare(0, header_len, SNAPSHOT_HEADER) != 0) {
+		fprintf(stderr, "error: not a snapshot: %s\n", path.c_str());
+		return false;
+	}
+	size_t pos = header_len;
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		if (end == std::string::npos) end = text.size();
+		char const *p = text.c_str() + pos;
+		char *q;
+		File f;
+		f.size = strtoull(p, &q, 10);
+		bool ok = *q == ' ';
+		f.mtime = ok ? strtoll(q + 1, &q, 10) : 0;
+		ok = ok && *q == ' ';
+		f.ino = ok ? strtoull(q + 1, &q, 10) : 0;
+		ok = ok && *q == ' ';
+		if (ok && q[1] == '-') {
+			q += 2;
+		} else if (ok) {
+			f.hash = strtoull(q + 1, &q, 16);
+			f.has_hash = true;
+		}
+		ok = ok && *q == ' ';
+		if (!ok) {
+			fprintf(stderr, "error: broken snapshot: %s\n", path.c_str());
+			files.clear();
+			return false;
+		}
+		std::string name;
+		for (p = q + 1; p < text.c_str() + end; p++) {
+			if (*p == '\\' && p + 1 < text.c_str() + end) {
+				p++;
+				name += *p == 'n' ? '\n' : *p;
+			} else {
+				name += *p;
+			}
+		}
+		files[name] = f;
+		pos = end + 1;
+	}
+	return true;
+}
+
+/**
+ * @brief Save the snapshot as a manifest
+ *
+ * The manifest is written to a temporary file that then replaces the
+ * previous one, so an interrupted run leaves the previous manifest intact.
+ * @param path Path to the manifest
+ * @return true if successful, false otherwise
+ */
+bool Snapshot::save(std::string const &path) const
+{
+	std::vector<std::pair<std::string const *, File const *>> sorted;
+	sorted.reserve(files.size());
+	for (auto const &pair : files) {
+		sorted.push_back({&pair.first, &pair.second});
+	}
+	std::sort(sorted.begin(), sorted.end(), [](auto const &a, auto const &b){
+		return *a.first < *b.first;
+	});
+
+	std::string text = SNAPSHOT_HEADER;
+	char tmp[100];
+	for (auto const &pair : sorted) {
+		File const &f = *pair.second;
+		if (f.has_hash) {
+			snprintf(tmp, sizeof(tmp), "%llu %lld %llu %016llx ", (unsigned long long)f.size, (long long)f.mtime, (unsigned long long)f.ino, (unsigned long long)f.hash);
+		} else {
+			snprintf(tmp, sizeof(tmp), "%llu %lld %llu - ", (unsigned long long)f.size, (long long)f.mtime, (unsigned long long)f.ino);
+		}
+		text += tmp;
+		for (char c : *pair.first) {
+			if (c == '\\') {
+				text += "\\\\";
+			} else if (c == '\n') {
+				text += "\\n";
+			} else {
+				text += c;
+			}
+		}
+		text += '\n';
+	}
+
+	const std::string tmppath = path + ".tmp";
+	int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "error: failed to create the snapshot: %s\n", tmppath.c_str());
+		return false;
+	}
+	char const *ptr = text.data();
+	size_t len = text.size();
+	while (len > 0) {
+		auto n = ::write(fd, ptr, len);
+		if (n < 1) break;
+		ptr += n;
+		len -= n;
+	}
+	if (close(fd) != 0 || len > 0) {
+		fprintf(stderr, "error: failed to write the snapshot: %s\n", tmppath.c_str());
+		remove(tmppath.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	remove(path.c_str());
+#endif
+	if (rename(tmppath.c_str(), path.c_str()) != 0) {
+		fprintf(stderr, "error: failed to replace the snapshot: %s\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Compute the XXH64 hash of the content of a file
+ * @param path Path to the file
+ * @param hash Output hash
+ * @return true if successful, false if the file could not be read
+ */
+bool Snapshot::hash_file(std::string const &path, uint64_t *hash)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+	if (fd == -1) return false;
+	XXH64_state_t xxh;
+	XXH64_reset(&xxh, 0);
+	std::vector<char> buf(1 << 20);
+	bool ok = true;
+	while (1) {
+		auto n = ::read(fd, buf.data(), buf.size());
+		if (n < 0) {
+			ok = false;
+			break;
+		}
+		if (n == 0) break;
+		XXH64_update(&xxh, buf.data(), n);
+	}
+	close(fd);
+	*hash = XXH64_digest(&xxh);
+	return ok;
+}
@@ -0,0 +1,27 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief State of an archived tree, used to find what changed since the previous archive
+ */
+class Snapshot {
+public:
+	struct File {
+		uint64_t size = 0;
+		int64_t mtime = 0; // nanoseconds since the epoch
+		uint64_t ino = 0;
+		uint64_t hash = 0; // XXH64 of the content, valid if has_hash
+		bool has_hash = false;
+	};
+	std::unordered_map<std::string, File> files; // by path in the archive
+
+	bool load(std::string const &path);
+	bool save(std::string const &path) const;
+	static bool hash_file(std::string const &path, uint64_t *hash);
+};
+
+#endif // SNAPSHOT_H
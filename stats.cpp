@@ -0,0 +1,259 @@
+#include "stats.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+namespace {
+
+char const *const STAGE_NAMES[] = {
+	"scan",
+	"read",
+	"tar",
+	"compress",
+	"decompress",
+	"write",
+};
+
+// The thread CPU clock costs a system call, so it is read at most this often
+const uint64_t CPU_SAMPLE_NS = 50000;
+
+/**
+ * @brief Per-thread timing state
+ */
+struct ThreadState {
+	Stats *stats = nullptr;
+	int stage = -1; // innermost open scope
+	uint64_t wall = 0; // wall clock when the stage was last charged
+	uint64_t cpu = 0; // thread CPU clock at the last sample
+	uint64_t cpu_wall = 0; // wall clock at the last sample
+	uint64_t window[Stats::StageCount] = {}; // wall time per stage since the last sample
+};
+
+thread_local ThreadState tls;
+
+/**
+ * @brief Get the monotonic clock in nanoseconds
+ */
+uint64_t wall_clock()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Get a CPU time clock in nanoseconds
+ * @param id CLOCK_THREAD_CPUTIME_ID or CLOCK_PROCESS_CPUTIME_ID
+ * @return CPU time (0 where not supported)
+ */
+uint64_t cpu_clock(int id)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+	if (clock_gettime(id, &ts) == 0) {
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+#else
+	(void)id;
+#endif
+	return 0;
+}
+
+#ifndef CLOCK_THREAD_CPUTIME_ID
+#define CLOCK_THREAD_CPUTIME_ID 0
+#define CLOCK_PROCESS_CPUTIME_ID 0
+#endif
+
+} // namespace
+
+/**
+ * @brief Open a timed scope for a stage
+ *
+ * Scopes nest: while a scope is open, the enclosing scope of the same
+ * thread is paused, so every stage gets only its own (exclusive) time.
+ * A transition costs one reading of the wall clock; see transition() for
+ * CPU time. Nothing is done if stats is nullptr.
+ * @param stats Statistics to record into (may be nullptr)
+ * @param stage Stage to charge
+ */
+Stats::Scope::Scope(Stats *stats, Stage stage)
+	: stats_(stats)
+	, stage_(stage)
+{
+	if (!stats_) return;
+	const uint64_t wall = wall_clock();
+	if (tls.stats != stats_) {
+		tls = {};
+		tls.stats = stats_;
+		tls.cpu = cpu_clock(CLOCK_THREAD_CPUTIME_ID);
+		tls.cpu_wall = wall;
+	}
+	stats_->transition(wall);
+	parent_ = tls.stage;
+	tls.stage = stage_;
+	stats_->counters_[stage_].calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Close the scope and resume the enclosing one
+ */
+Stats::Scope::~Scope()
+{
+	if (!stats_) return;
+	stats_->transition(wall_clock());
+	tls.stage = parent_;
+}
+
+/**
+ * @brief Count bytes processed by the stage of this scope
+ * @param in Bytes consumed
+ * @param out Bytes produced
+ */
+void Stats::Scope::bytes(uint64_t in, uint64_t out)
+{
+	if (!stats_) return;
+	stats_->add(stage_, in, out);
+}
+
+/**
+ * @brief Constructor for Stats; the total time is measured from here
+ */
+Stats::Stats()
+	: start_wall_(wall_clock())
+	, start_cpu_(cpu_clock(CLOCK_PROCESS_CPUTIME_ID))
+{
+}
+
+/**
+ * @brief Charge the wall time since the last transition to the current stage of this thread
+ *
+ * The wall clock is charged exactly. The thread CPU clock is sampled only
+ * when enough time has passed, and the CPU time since the previous sample
+ * is split among the stages in proportion to their wall time.
+ * @param wall Current wall clock
+ * @param sample_cpu Sample the CPU clock regardless of the time passed
+ */
+void Stats::transition(uint64_t wall, bool sample_cpu)
+{
+	if (tls.stage >= 0) {
+		const uint64_t d = wall - tls.wall;
+		counters_[tls.stage].wall_ns.fetch_add(d, std::memory_order_relaxed);
+		tls.window[tls.stage] += d;
+	}
+	tls.wall = wall;
+	if (!sample_cpu && wall - tls.cpu_wall < CPU_SAMPLE_NS) return;
+
+	const uint64_t cpu = cpu_clock(CLOCK_THREAD_CPUTIME_ID);
+	uint64_t total = 0;
+	for (int i = 0; i < StageCount; i++) {
+		total += tls.window[i];
+	}
+	if (total > 0) {
+		const double ratio = double(cpu - tls.cpu) / total;
+		for (int i = 0; i < StageCount; i++) {
+			if (tls.window[i] == 0) continue;
+			counters_[i].cpu_ns.fetch_add((uint64_t)(tls.window[i] * ratio), std::memory_order_relaxed);
+			tls.window[i] = 0;
+		}
+	}
+	tls.cpu = cpu;
+	tls.cpu_wall = wall;
+}
+
+/**
+ * @brief Count bytes processed by a stage outside of a scope
+ * @param stage Stage
+ * @param bytes_in Bytes consumed
+ * @param bytes_out Bytes produced
+ */
+void Stats::add(Stage stage, uint64_t bytes_in, uint64_t bytes_out)
+{
+	if (bytes_in) counters_[stage].bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+	if (bytes_out) counters_[stage].bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Report the amount of data held in one kind of buffer
+ *
+ * The peak of the total over all buffers is kept.
+ * @param buffer Buffer kind
+ * @param bytes Bytes currently held
+ */
+void Stats::buffered(Buffer buffer, uint64_t bytes)
+{
+	buffered_[buffer].store(bytes, std::memory_order_relaxed);
+	for (int i = 0; i < BufferCount; i++) {
+		if (i != buffer) bytes += buffered_[i].load(std::memory_order_relaxed);
+	}
+	uint64_t peak = peak_buffered_.load(std::memory_order_relaxed);
+	while (bytes > peak && !peak_buffered_.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+		// retry
+	}
+}
+
+/**
+ * @brief Stop measuring the total wall and process CPU time
+ */
+void Stats::finish()
+{
+	if (tls.stats == this) {
+		transition(wall_clock(), true);
+	}
+	wall_ns_ = wall_clock() - start_wall_;
+	cpu_ns_ = cpu_clock(CLOCK_PROCESS_CPUTIME_ID) - start_cpu_;
+}
+
+/**
+ * @brief Format the statistics as a table
+ *
+ * Stage times are summed over threads, so with worker threads they may
+ * add up to more than the total wall time.
+ * @return Report text
+ */
+std::string Stats::text() const
+{
+	std::string s;
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%-12s %10s %12s %12s %12s %12s\n", "stage", "calls", "in MB", "out MB", "wall ms", "cpu ms");
+	s += tmp;
+	for (int i = 0; i < StageCount; i++) {
+		Counter const &c = counters_[i];
+		const uint64_t calls = c.calls.load(std::memory_order_relaxed);
+		if (calls == 0) continue;
+		const double in = c.bytes_in.load(std::memory_order_relaxed) / 1e6;
+		const double out = c.bytes_out.load(std::memory_order_relaxed) / 1e6;
+		const double wall = c.wall_ns.load(std::memory_order_relaxed) / 1e6;
+		const double cpu = c.cpu_ns.load(std::memory_order_relaxed) / 1e6;
+		snprintf(tmp, sizeof(tmp), "%-12s %10llu %12.1f %12.1f %12.1f %12.1f\n", STAGE_NAMES[i], (unsigned long long)calls, in, out, wall, cpu);
+		s += tmp;
+	}
+	snprintf(tmp, sizeof(tmp), "%-12s %10s %12s %12s %12.1f %12.1f\n", "total", "", "", "", wall_ns_ / 1e6, cpu_ns_ / 1e6);
+	s += tmp;
+	snprintf(tmp, sizeof(tmp), "peak buffered: %.1f MB\n", peak_buffered_.load(std::memory_order_relaxed) / 1e6);
+	s += tmp;
+	return s;
+}
+
+/**
+ * @brief Format the statistics as JSON
+ * @return JSON text
+ */
+std::string Stats::json() const
+{
+	std::string s = "{\"stages\":{";
+	char tmp[256];
+	bool first = true;
+	for (int i = 0; i < StageCount; i++) {
+		Counter const &c = counters_[i];
+		const uint64_t calls = c.calls.load(std::memory_order_relaxed);
+		if (calls == 0) continue;
+		const unsigned long long in = c.bytes_in.load(std::memory_order_relaxed);
+		const unsigned long long out = c.bytes_out.load(std::memory_order_relaxed);
+		const double wall = c.wall_ns.load(std::memory_order_relaxed) / 1e6;
+		const double cpu = c.cpu_ns.load(std::memory_order_relaxed) / 1e6;
+		snprintf(tmp, sizeof(tmp), "%s\"%s\":{\"calls\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", first ? "" : ",", STAGE_NAMES[i], (unsigned long long)calls, in, out, wall, cpu);
+		s += tmp;
+		first = false;
+	}
+	snprintf(tmp, sizeof(tmp), "},\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"peak_buffered_bytes\":%llu}\n", wall_ns_ / 1e6, cpu_ns_ / 1e6, (unsigned long long)peak_buffered_.load(std::memory_order_relaxed));
+	s += tmp;
+	return s;
+}
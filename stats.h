@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class Stats {
+public:
+	enum Stage {
+		Scan,
+		Read,
+		Tar,
+		Compress,
+		Decompress,
+		Write,
+		StageCount,
+	};
+	enum Buffer {
+		TarBuffers,
+		CompressBuffers,
+		DecompressQueue,
+		WriteQueue,
+		BufferCount,
+	};
+
+	class Scope {
+	private:
+		Stats *stats_;
+		Stage stage_;
+		int parent_ = -1;
+	public:
+		Scope(Stats *stats, Stage stage);
+		~Scope();
+		Scope(Scope const &) = delete;
+		Scope &operator = (Scope const &) = delete;
+		void bytes(uint64_t in, uint64_t out = 0);
+	};
+private:
+	struct Counter {
+		std::atomic<uint64_t> calls { 0 };
+		std::atomic<uint64_t> bytes_in { 0 };
+		std::atomic<uint64_t> bytes_out { 0 };
+		std::atomic<uint64_t> wall_ns { 0 };
+		std::atomic<uint64_t> cpu_ns { 0 };
+	};
+	Counter counters_[StageCount];
+	std::atomic<uint64_t> buffered_[BufferCount] {};
+	std::atomic<uint64_t> peak_buffered_ { 0 };
+	uint64_t start_wall_ = 0;
+	uint64_t start_cpu_ = 0;
+	uint64_t wall_ns_ = 0;
+	uint64_t cpu_ns_ = 0;
+	void transition(uint64_t wall, bool sample_cpu = false);
+public:
+	Stats();
+	Stats(Stats const &) = delete;
+	Stats &operator = (Stats const &) = delete;
+	void add(Stage stage, uint64_t bytes_in, uint64_t bytes_out = 0);
+	void buffered(Buffer buffer, uint64_t bytes);
+	void finish();
+	std::string text() const;
+	std::string json() const;
+};
+
+#endif // STATS_H
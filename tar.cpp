@@ -1,22 +1,47 @@
 #include "tar.h"
 #include "../tzst/joinpath.h"
 #include "misc.h"
+#include "stats.h"
 #include <cstdlib>
 #include <fcntl.h>
+#include <map>
 #include <memory>
 #include <set>
 #include <sys/stat.h>
 #include <thread>
+#include <cerrno>
 #include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#define XXH_STATIC_LINKING_ONLY
+#include <common/xxhash.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 #include <io.h>
 #define PATH_MAX _MAX_PATH
+#define lseek _lseeki64
+#define ftruncate _chsize_s
 #else
 #include <unistd.h>
 #define O_BINARY (0)
 #endif
 
+#ifndef POSIX_FADV_DONTNEED
+// No page cache hints on this platform
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#define posix_fadvise(fd, offset, len, advice) (0)
+#endif
+
 #define REGTYPE		'0'	/* Regular file (preferred code).  */
 #define AREGTYPE	'\0'	/* Regular file (alternate code).  */
 #define LNKTYPE		'1'	/* Hard link.  */
@@ -27,6 +52,8 @@
 #define FIFOTYPE	'6'	/* Named pipe.  */
 #define CONTTYPE	'7'	/* Contiguous file */
 #define LONGLINKTYPE	'L'	/* LongLink */
+#define LONGLINKNAMETYPE	'K'	/* Long link name */
+#define PAXTYPE		'x'	/* PAX extended header */
 
 struct TarHeader {
 	char name[100];
@@ -48,443 +75,2209 @@ struct TarHeader {
 };
 
 /**
- * @brief Write data to the tar archive
- * @param ptr Pointer to data buffer
- * @param len Length of data to write
- * @return Number of bytes written
+ * @brief Write a value as zero-padded octal digits
+ * @param p Output position
+ * @param digits Number of digits
+ * @param value Value to store (must fit into the digits)
+ */
+static inline void put_octal(char *p, size_t digits, uint64_t value)
+{
+	for (size_t i = digits; i > 0; i--) {
+		p[i - 1] = (char)('0' + (value & 7));
+		value >>= 3;
+	}
+}
+
+/**
+ * @brief Format a numeric header field
+ *
+ * Values that fit are written as NUL-terminated octal; larger values use
+ * the GNU base-256 encoding (first byte 0x80, big endian binary).
+ * @param field Header field
+ * @param len Length of the field
+ * @param value Value to store
+ */
+static void format_numeric(char *field, size_t len, uint64_t value)
+{
+	if (len - 1 >= 22 || value < ((uint64_t)1 << (3 * (len - 1)))) {
+		put_octal(field, len - 1, value);
+		field[len - 1] = 0;
+	} else {
+		memset(field, 0, len);
+		field[0] = (char)0x80;
+		for (size_t i = len - 1; i > 0 && value != 0; i--) {
+			field[i] = (char)(value & 0xff);
+			value >>= 8;
+		}
+	}
+}
+
+/**
+ * @brief Sum the bytes of a header block
+ *
+ * Uses SSE2 where available: sums of absolute differences for the sum,
+ * and per-lane counters for the bytes with the high bit set.
+ * @param block 512-byte header block
+ * @param high Output number of bytes >= 0x80 (the signed sum is sum - 256 * high)
+ * @return Unsigned byte sum
+ */
+static uint32_t header_sum(char const *block, uint32_t *high)
+{
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	__m128i neg = _mm_setzero_si128();
+	for (int i = 0; i < 512; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(block + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+		neg = _mm_sub_epi8(neg, _mm_cmplt_epi8(v, zero)); // at most 32 per lane
+	}
+	neg = _mm_sad_epu8(neg, zero);
+	*high = (uint32_t)(_mm_cvtsi128_si32(neg) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(neg, neg)));
+	return (uint32_t)(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc)));
+#else
+	uint32_t sum = 0;
+	uint32_t n = 0;
+	for (int i = 0; i < 512; i++) {
+		unsigned char c = (unsigned char)block[i];
+		sum += c;
+		n += c >> 7;
+	}
+	*high = n;
+	return sum;
+#endif
+}
+
+/**
+ * @brief Get a NUL-terminated string field as a view bounded by the field size
+ * @param field Header field
+ * @param len Length of the field
+ * @return View of the field content
+ */
+static inline std::string_view field_view(char const *field, size_t len)
+{
+	void const *z = memchr(field, 0, len);
+	return std::string_view(field, z ? (size_t)((char const *)z - field) : len);
+}
+
+/**
+ * @brief Parse a numeric header field (octal or GNU base-256)
+ * @param field Header field
+ * @param len Length of the field
+ * @return Parsed value
+ */
+static uint64_t parse_numeric(char const *field, size_t len)
+{
+	unsigned char const *p = (unsigned char const *)field;
+	uint64_t value = 0;
+	if (p[0] & 0x80) {
+		// Base-256: the remaining bits of the first byte and the following bytes
+		value = p[0] & 0x3f;
+		for (size_t i = 1; i < len; i++) {
+			value = (value << 8) | p[i];
+		}
+	} else {
+		size_t i = 0;
+		while (i < len && p[i] == ' ') i++;
+		while (i < len && p[i] >= '0' && p[i] <= '7') {
+			value = (value << 3) | (p[i] - '0');
+			i++;
+		}
+	}
+	return value;
+}
+
+/**
+ * @brief Find the data regions of a file with holes
+ *
+ * Only files that occupy fewer blocks than their size, by at least
+ * min_hole bytes, are examined with SEEK_DATA and SEEK_HOLE.
+ * @param fd File descriptor
+ * @param st Status of the file
+ * @param min_hole Minimum number of bytes in holes
+ * @param out Output data regions in file order; the last one ends at the end of the file
+ * @return true if the file has holes, false otherwise
+ */
+static bool find_data_regions(int fd, struct stat const &st, uint64_t min_hole, std::vector<tar::SparseRegion> *out)
+{
+	out->clear();
+#if defined(SEEK_HOLE) && !defined(_WIN32)
+	const uint64_t size = st.st_size;
+	if ((uint64_t)st.st_blocks * 512 + min_hole > size) return false;
+	uint64_t pos = 0;
+	uint64_t data_size = 0;
+	bool ok = true;
+	while (pos < size) {
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) break; // only a hole is left
+		off_t hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+		if (hole < 0) {
+			ok = false; // not supported by the file system
+			break;
+		}
+		const uint64_t end = std::min((uint64_t)hole, size);
+		out->push_back({(uint64_t)data, end - data});
+		data_size += end - data;
+		pos = end;
+	}
+	lseek(fd, 0, SEEK_SET);
+	if (!ok || data_size + min_hole > size) {
+		out->clear();
+		return false;
+	}
+	if (out->empty() || out->back().offset + out->back().length < size) {
+		out->push_back({size, 0});
+	}
+	return true;
+#else
+	(void)fd;
+	(void)st;
+	(void)min_hole;
+	return false;
+#endif
+}
+
+/**
+ * @brief Check whether a file name has the extension of an already compressed format
+ * @param filename File name
+ * @return true if the content is most likely incompressible
+ */
+static bool has_compressed_extension(std::string const &filename)
+{
+	static char const *const extensions[] = {
+		"7z", "apk", "avi", "avif", "br", "bz2", "docx", "flac", "gif", "gz",
+		"heic", "jar", "jpeg", "jpg", "lz4", "lzma", "m4a", "m4v", "mkv", "mov",
+		"mp3", "mp4", "ogg", "opus", "png", "pptx", "rar", "tbz2", "tgz", "txz",
+		"webm", "webp", "whl", "woff2", "xlsx", "xz", "zip", "zst",
+	};
+	auto dot = filename.find_last_of("./");
+	if (dot == std::string::npos || filename[dot] != '.') return false;
+	std::string ext = filename.substr(dot + 1);
+	if (ext.size() > 5) return false;
+	for (char &c : ext) {
+		c = (char)tolower((unsigned char)c);
+	}
+	for (char const *e : extensions) {
+		if (ext == e) return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Estimate whether a block of data is incompressible
+ *
+ * The order-0 entropy of 64 KB, sampled evenly across the block, is
+ * compared against a threshold just below 8 bits per byte. Already
+ * compressed or encrypted data stays above it.
+ * @param ptr Pointer to data
+ * @param len Length of data
+ * @return true if the data is most likely incompressible
+ */
+static bool is_high_entropy(char const *ptr, size_t len)
+{
+	const size_t slice = 4096;
+	const size_t nslices = 16;
+	if (len < slice * nslices) return false;
+
+	uint32_t histogram[256] = {};
+	const size_t step = len / nslices;
+	for (size_t i = 0; i < nslices; i++) {
+		unsigned char const *p = (unsigned char const *)ptr + i * step;
+		for (size_t j = 0; j < slice; j++) {
+			histogram[p[j]]++;
+		}
+	}
+	const double total = (double)(slice * nslices);
+	double entropy = 0;
+	for (uint32_t n : histogram) {
+		if (n > 0) {
+			const double p = n / total;
+			entropy -= p * log2(p);
+		}
+	}
+	return entropy > 7.9;
+}
+
+/**
+ * @brief Write data to the tar archive
+ *
+ * Small pieces (headers, padding, small bodies) are gathered into a batch
+ * that is passed to the writer in one call; large pieces go to the writer
+ * directly, after the batch.
+ * @param ptr Pointer to data buffer
+ * @param len Length of data to write
+ * @return Number of bytes written, -1 once the writer has failed
+ */
+int tar::TarWriter::write(const char *ptr, int len)
+{
+	if ((size_t)len >= DIRECT_SIZE) {
+		if (!flush()) return -1;
+		if (stats_) stats_->add(Stats::Tar, 0, len);
+		if (writer_(ptr, len) != len) {
+			write_failed_ = true;
+			return -1;
+		}
+		return len;
+	}
+	if (batch_.size() + len > BATCH_SIZE) {
+		flush();
+	}
+	batch_.insert(batch_.end(), ptr, ptr + len);
+	return len;
+}
+
+/**
+ * @brief Pass the gathered batch to the writer
+ *
+ * Once the writer has failed, data is dropped instead.
+ * @return false if the writer has failed
+ */
+bool tar::TarWriter::flush()
+{
+	if (!batch_.empty()) {
+		if (!write_failed_) {
+			if (stats_) stats_->add(Stats::Tar, 0, batch_.size());
+			if (writer_(batch_.data(), (int)batch_.size()) != (int)batch_.size()) {
+				write_failed_ = true;
+			}
+		}
+		batch_.clear();
+	}
+	return !write_failed_;
+}
+
+/**
+ * @brief Switch the consumer between compressing and storing
+ * @param store true to store subsequent data
+ */
+void tar::TarWriter::set_store(bool store)
+{
+	// Everything written so far belongs to the previous state
+	flush();
+	store_fn_(store);
+}
+
+/**
+ * @brief Encode a tar header block
+ *
+ * Fields are written with fixed-width octal formatting and the checksum is
+ * the unsigned byte sum required by POSIX. Nothing is allocated.
+ * @param info Header fields
+ * @param block Output 512-byte block
+ */
+void tar::encode_header(HeaderInfo const &info, char *block)
+{
+	memset(block, 0, 512);
+	TarHeader *h = (TarHeader *)block;
+	// Copy filename (max 100 bytes)
+	memcpy(h->name, info.name.data(), std::min(sizeof(h->name), info.name.size()));
+	// Format metadata fields in octal
+	put_octal(h->mode, 7, info.mode & 07777777);
+	put_octal(h->uid, 7, info.uid & 07777777);
+	put_octal(h->gid, 7, info.gid & 07777777);
+	format_numeric(h->size, sizeof(h->size), info.size);
+	format_numeric(h->mtime, sizeof(h->mtime), info.mtime);
+	memset(h->chksum, ' ', 8);
+	h->typeflag[0] = info.typeflag;
+	memcpy(h->linkname, info.linkname.data(), std::min(sizeof(h->linkname), info.linkname.size()));
+	if (info.posix) {
+		memcpy(h->magic, "ustar", 6);
+		memcpy(h->version, "00", 2);
+	} else {
+		// GNU tar format
+		memcpy(h->magic, "ustar ", 6);
+		memcpy(h->version, " ", 2);
+	}
+	memcpy(h->uname, info.uname.data(), std::min(sizeof(h->uname), info.uname.size()));
+	memcpy(h->gname, info.gname.data(), std::min(sizeof(h->gname), info.gname.size()));
+
+	// Checksum: six octal digits, NUL and space
+	uint32_t high;
+	put_octal(h->chksum, 6, header_sum(block, &high));
+	h->chksum[6] = 0;
+}
+
+/**
+ * @brief Decode a tar header block
+ *
+ * The checksum is accepted as either the unsigned byte sum required by
+ * POSIX or the signed sum written by some historic implementations.
+ * String fields are returned as views into the block, bounded by their
+ * field size; nothing is allocated.
+ * @param block 512-byte header block
+ * @param info Output header fields
+ * @return true if the checksum is correct, false otherwise
+ */
+bool tar::decode_header(char const *block, HeaderInfo *info)
+{
+	TarHeader const *h = (TarHeader const *)block;
+
+	// The checksum is computed with its own field taken as eight spaces
+	uint32_t high;
+	uint32_t sum = header_sum(block, &high);
+	for (size_t i = 0; i < sizeof(h->chksum); i++) {
+		unsigned char c = (unsigned char)h->chksum[i];
+		sum -= c;
+		high -= c >> 7;
+	}
+	sum += 8 * ' ';
+	const uint64_t chksum = parse_numeric(h->chksum, sizeof(h->chksum));
+	if (chksum != sum && chksum != (uint32_t)(sum - 256 * high)) {
+		return false;
+	}
+
+	info->name = field_view(h->name, sizeof(h->name));
+	info->uname = field_view(h->uname, sizeof(h->uname));
+	info->gname = field_view(h->gname, sizeof(h->gname));
+	info->linkname = field_view(h->linkname, sizeof(h->linkname));
+	info->mode = (uint32_t)parse_numeric(h->mode, sizeof(h->mode));
+	info->uid = (uint32_t)parse_numeric(h->uid, sizeof(h->uid));
+	info->gid = (uint32_t)parse_numeric(h->gid, sizeof(h->gid));
+	info->size = parse_numeric(h->size, sizeof(h->size));
+	info->mtime = parse_numeric(h->mtime, sizeof(h->mtime));
+	info->typeflag = h->typeflag[0];
+	return true;
+}
+
+/**
+ * @brief Write a tar header block
+ *
+ * The header is encoded in place in the output batch.
+ * @param info Header fields
+ */
+void tar::TarWriter::write_header(HeaderInfo const &info)
+{
+	if (batch_.size() + 512 > BATCH_SIZE) {
+		flush();
+	}
+	batch_.resize(batch_.size() + 512);
+	encode_header(info, batch_.data() + batch_.size() - 512);
+}
+
+/**
+ * @brief Write zero padding up to the next 512-byte boundary
+ * @param len Length of the content preceding the padding
+ */
+void tar::TarWriter::write_padding(uint64_t len)
+{
+	static const char zeros[512] = {};
+	int n = (int)(len % 512);
+	if (n > 0) {
+		write(zeros, 512 - n);
+	}
+}
+
+/**
+ * @brief Write file content to tar archive with padding
+ *
+ * The content is passed to the writer as is, without being split into
+ * 512-byte blocks.
+ * @param ptr Pointer to content data
+ * @param len Length of content
+ */
+void tar::TarWriter::write_content(const char *ptr, size_t len)
+{
+	if (ptr && len > 0) {
+		size_t offset = 0;
+		while (offset < len) {
+			int n = (int)std::min(len - offset, (size_t)1 << 30);
+			write(ptr + offset, n);
+			offset += n;
+		}
+		// Pad to 512-byte boundary
+		write_padding(len);
+	}
+}
+
+/**
+ * @brief Write end-of-archive marker (two zero blocks)
+ */
+void tar::TarWriter::write_end()
+{
+	char tmp[1024];
+	memset(tmp, 0, 1024);
+	write(tmp, 1024);
+}
+
+/**
+ * @brief Constructor for TarWriter
+ * @param writer Callback function for writing data
+ */
+tar::TarWriter::TarWriter(std::function<int (const char *, int)> writer)
+	: writer_(writer)
+{
+	batch_.reserve(BATCH_SIZE);
+}
+
+/**
+ * @brief Set a callback invoked before each entry is written
+ *
+ * The callback receives the metadata of the entry and the number of bytes
+ * it will occupy in the tar stream (headers, content and padding), which
+ * allows the consumer to align its own framing to entry boundaries and to
+ * build an index. A callback returning false fails the writer, like a
+ * failed write.
+ * @param fn Callback function
+ */
+void tar::TarWriter::set_entry_callback(std::function<bool (TarData const &data, uint64_t size)> fn)
+{
+	entry_fn_ = fn;
+}
+
+/**
+ * @brief Set a callback that switches the consumer between compressing and storing
+ *
+ * The callback is called with true before content that is not worth
+ * compressing (files in compressed formats, or high-entropy chunks of
+ * other files) and with false after it. Headers are always written in
+ * the compressing state.
+ * @param fn Callback function
+ */
+void tar::TarWriter::set_store_callback(std::function<void (bool store)> fn)
+{
+	store_fn_ = fn;
+}
+
+/**
+ * @brief Enable writing files with the content of a file archived before as hard links
+ *
+ * Files of the same size are hashed before they are archived; a file
+ * whose size and content hash match one archived before becomes a link
+ * to it. Other names of the same file are linked regardless.
+ * @param dedup true to deduplicate by content
+ */
+void tar::TarWriter::set_dedup(bool dedup)
+{
+	dedup_ = dedup;
+}
+
+/**
+ * @brief Set the I/O backend that small source files are read with
+ *
+ * Files smaller than READ_AHEAD_FILE_SIZE are read ahead in batches, which
+ * the io_uring backend opens, reads and closes with a few system calls.
+ * @param type Backend type
+ */
+void tar::TarWriter::set_io_backend(io::Backend::Type type)
+{
+	io_type_ = type;
+}
+
+/**
+ * @brief Set the page cache hints given for source files
+ *
+ * Dropping the cached pages of files once they are archived keeps a large
+ * archive job from evicting the page cache of other programs. Readahead
+ * opens the next READAHEAD_FILES large files early and asks the kernel to
+ * read up to READAHEAD_WINDOW bytes of each while earlier files are
+ * compressed; the files are then read through the same descriptors. It
+ * also marks files as read sequentially.
+ * @param drop_cache true to drop the cached pages of each file once read
+ * @param readahead true to read upcoming files ahead
+ */
+void tar::TarWriter::set_cache_hints(bool drop_cache, bool readahead)
+{
+	drop_cache_ = drop_cache;
+	readahead_ = readahead;
+}
+
+/**
+ * @brief Set the statistics to record the scan, read and tar stages into
+ * @param stats Statistics (nullptr: none)
+ */
+void tar::TarWriter::set_stats(Stats *stats)
+{
+	stats_ = stats;
+}
+
+/**
+ * @brief Enable printing every archived file and directory to stderr
+ * @param verbose true to print
+ */
+void tar::TarWriter::set_verbose(bool verbose)
+{
+	verbose_ = verbose;
+}
+
+/**
+ * @brief Set a callback function reporting progress
+ *
+ * It is called after every file and, for large files, after every chunk.
+ * Totals are known once archive() has scanned the source directory.
+ * @param fn Callback function
+ */
+void tar::TarWriter::set_progress_callback(std::function<void (Progress const &progress)> fn)
+{
+	progress_fn_ = fn;
+}
+
+/**
+ * @brief Get the amount of memory held by the read and batch buffers
+ * @return Bytes held
+ */
+size_t tar::TarWriter::buffered() const
+{
+	return iobuf_.capacity() + batch_.capacity();
+}
+
+/**
+ * @brief Finalize the tar archive
+ * @return false if the writer has failed
+ */
+bool tar::TarWriter::finish()
+{
+	write_end();
+	return flush();
+}
+
+/**
+ * @brief Set the owner fields that all entries are written with
+ * @param info Header fields
+ */
+static void set_owner(tar::HeaderInfo *info)
+{
+	info->uname = "nobody";
+	info->gname = "nogroup";
+	info->uid = 65534;
+	info->gid = 65534;
+}
+
+/**
+ * @brief Append a PAX extended header record
+ * @param out Content of the extended header
+ * @param key Record keyword
+ * @param value Record value
+ */
+static void append_pax_record(std::string *out, std::string_view key, std::string_view value)
+{
+	// "<length> <key>=<value>\n", where the length counts its own digits
+	const size_t len = key.size() + value.size() + 3;
+	size_t total = len + 1;
+	while (std::to_string(total).size() + len > total) {
+		total++;
+	}
+	*out += std::to_string(total);
+	*out += ' ';
+	*out += key;
+	*out += '=';
+	*out += value;
+	*out += '\n';
+}
+
+/**
+ * @brief Call the entry callback before the headers of an entry are written
+ * @param info Fields of the main header
+ * @param filename Path/name of the entry
+ * @param length Length of the content of the entry
+ * @param size Number of bytes the entry occupies in the tar stream
+ */
+void tar::TarWriter::begin_entry(HeaderInfo const &info, std::string const &filename, uint64_t length, uint64_t size)
+{
+	// The strings keep their capacity from entry to entry
+	entry_.filename.assign(filename);
+	entry_.mode = info.mode;
+	entry_.uname.assign(info.uname);
+	entry_.gname.assign(info.gname);
+	entry_.uid = info.uid;
+	entry_.gid = info.gid;
+	entry_.typeflag = info.typeflag;
+	entry_.length = length;
+	// The consumer sees the stream up to the start of the entry
+	if (flush() && !entry_fn_(entry_, size)) {
+		write_failed_ = true;
+	}
+}
+
+/**
+ * @brief Write the header(s) of a file, directory or hard link entry
+ * @param filename Path/name of the file or directory (directories end with '/')
+ * @param content_length Length of file content (0 for directories and links)
+ * @param mtime Modification time in seconds since the epoch
+ * @param linkname Target of a hard link (empty for other entries)
+ */
+void tar::TarWriter::write_entry_header(const std::string &filename, uint64_t content_length, uint64_t mtime, std::string const &linkname)
+{
+	HeaderInfo info;
+	info.name = filename;
+	set_owner(&info);
+	info.mtime = mtime;
+	info.linkname = linkname;
+	// Check if it's a directory, hard link or regular file
+	if (filename[filename.size() - 1] == '/') {
+		info.mode = 0755;
+		info.typeflag = DIRTYPE;
+	} else if (!linkname.empty()) {
+		info.mode = 0644;
+		info.typeflag = LNKTYPE;
+	} else {
+		info.mode = 0644;
+		info.typeflag = REGTYPE;
+		info.size = content_length;
+	}
+
+	if (entry_fn_) {
+		auto Padded = [](uint64_t n){
+			return (n + 511) / 512 * 512;
+		};
+		uint64_t size = 512 + Padded(info.size);
+		if (filename.size() > 100) {
+			size += 512 + Padded(filename.size() + 1);
+		}
+		if (linkname.size() > 100) {
+			size += 512 + Padded(linkname.size() + 1);
+		}
+		begin_entry(info, filename, info.size, size);
+	}
+
+	// Handle long filenames (>100 chars) with GNU tar extension
+	if (filename.size() > 100) {
+		HeaderInfo ll;
+		ll.name = "././@LongLink";
+		ll.uname = "root";
+		ll.gname = "root";
+		ll.mtime = DEFAULT_MTIME;
+		ll.typeflag = LONGLINKTYPE;
+		ll.size = filename.size() + 1;
+		write_header(ll);
+		write_content(filename.c_str(), ll.size);
+	}
+	if (linkname.size() > 100) {
+		HeaderInfo ll;
+		ll.name = "././@LongLink";
+		ll.uname = "root";
+		ll.gname = "root";
+		ll.mtime = DEFAULT_MTIME;
+		ll.typeflag = LONGLINKNAMETYPE;
+		ll.size = linkname.size() + 1;
+		write_header(ll);
+		write_content(linkname.c_str(), ll.size);
+	}
+	write_header(info);
+}
+
+/**
+ * @brief Write a hard link entry
+ * @param filename Path/name of the link in the archive
+ * @param target Path of an entry written before, which the link refers to
+ * @param mtime Modification time in seconds since the epoch
+ */
+void tar::TarWriter::write_link(std::string const &filename, std::string const &target, uint64_t mtime)
+{
+	if (filename.empty() || target.empty()) return;
+
+	write_entry_header(filename, 0, mtime, target);
+}
+
+/**
+ * @brief Hash the content of a file for deduplication
+ *
+ * The file is read with pread(), so the file offset is left unchanged.
+ * @param fd File descriptor
+ * @param size Size of the file
+ * @param hash Output XXH64 hash
+ * @return true if successful, false if the file could not be read completely
+ */
+bool tar::TarWriter::hash_file(int fd, uint64_t size, uint64_t *hash)
+{
+	if (iobuf_.empty()) {
+		iobuf_.resize(IOBUF_SIZE);
+	}
+	XXH64_state_t xxh;
+	XXH64_reset(&xxh, 0);
+	uint64_t pos = 0;
+	// The rest of the file is not read once the writer has failed
+	while (pos < size && !write_failed_) {
+		size_t n = (size_t)std::min((uint64_t)iobuf_.size(), size - pos);
+		int64_t r;
+		{
+			Stats::Scope s(stats_, Stats::Read);
+			r = ::pread(fd, iobuf_.data(), n, pos);
+			if (r > 0) s.bytes(r);
+		}
+		if (r < 1) return false;
+		XXH64_update(&xxh, iobuf_.data(), r);
+		pos += r;
+	}
+	*hash = XXH64_digest(&xxh);
+	return true;
+}
+
+/**
+ * @brief Compare the content of a file with that of a file archived before
+ *
+ * Deduplication finds candidates by size and hash; comparing the bytes
+ * keeps a hash collision from replacing one file with another.
+ * @param fd File descriptor to read the content from with pread() (unused if data is given)
+ * @param data Content of the file, or nullptr to read it from fd
+ * @param other Source path of the file archived before
+ * @param size Size of both files
+ * @return true if the contents are equal, false if they differ or could not be read
+ */
+bool tar::TarWriter::same_content(int fd, char const *data, std::string const &other, uint64_t size)
+{
+	if (iobuf_.empty()) {
+		iobuf_.resize(IOBUF_SIZE);
+	}
+	const size_t half = iobuf_.size() / 2;
+	char *mine = iobuf_.data();
+	char *theirs = mine + half;
+	Stats::Scope s(stats_, Stats::Read);
+	int ofd = open(other.c_str(), O_RDONLY | O_BINARY);
+	if (ofd == -1) return false;
+	bool equal = true;
+	uint64_t pos = 0;
+	while (equal && pos < size) {
+		const size_t n = (size_t)std::min((uint64_t)half, size - pos);
+		if (!data) {
+			equal = misc::pread_fully(fd, mine, n, pos);
+		}
+		equal = equal && misc::pread_fully(ofd, theirs, n, pos) && memcmp(data ? data + pos : mine, theirs, n) == 0;
+		s.bytes(data ? n : 2 * n);
+		pos += n;
+	}
+	close(ofd);
+	return equal;
+}
+
+/**
+ * @brief Write a file or directory entry to tar archive
+ * @param filename Path/name of the file or directory
+ * @param content_begin Pointer to file content (nullptr for directories)
+ * @param content_length Length of file content (0 for directories)
+ * @param mtime Modification time in seconds since the epoch
+ */
+void tar::TarWriter::write_content(const std::string &filename, const char *content_begin, uint64_t content_length, uint64_t mtime)
+{
+	if (filename.empty()) return;
+
+	write_entry_header(filename, content_length, mtime);
+	if (filename[filename.size() - 1] != '/') {
+		write_content(content_begin, content_length);
+	}
+}
+
+/**
+ * @brief Write a regular file entry, streaming its content from a file descriptor
+ *
+ * The content is read in large chunks and passed to the writer directly,
+ * so the file is never held in memory as a whole. If the file shrinks
+ * while it is being read, the entry is filled up with zeros to keep the
+ * archive consistent.
+ * @param filename Path/name of the file in the archive
+ * @param fd File descriptor to read the content from
+ * @param size Size of the file as recorded in the header
+ * @param mtime Modification time in seconds since the epoch
+ * @return true if successful, false if the file could not be read completely
+ */
+bool tar::TarWriter::write_file(const std::string &filename, int fd, uint64_t size, uint64_t mtime)
+{
+	if (filename.empty()) return false;
+
+	write_entry_header(filename, size, mtime);
+	bool ok = write_data(filename, fd, size);
+	write_padding(size);
+	return ok;
+}
+
+/**
+ * @brief Write a sparse file entry in the PAX 1.0 sparse format
+ *
+ * A PAX header records the real name and size of the file; the content
+ * starts with the map of data regions as decimal text and holds only the
+ * data regions after it. Holes are neither read nor written.
+ * @param filename Path/name of the file in the archive
+ * @param fd File descriptor to read the content from
+ * @param size Size of the file
+ * @param mtime Modification time in seconds since the epoch
+ * @param regions Data regions in file order, ending at the end of the file
+ * @return true if successful, false if the file could not be read completely
+ */
+bool tar::TarWriter::write_sparse_file(std::string const &filename, int fd, uint64_t size, uint64_t mtime, std::vector<SparseRegion> const &regions)
+{
+	if (filename.empty()) return false;
+
+	// Map: number of regions, then offset and length of each, one per line
+	std::string map = std::to_string(regions.size()) + '\n';
+	uint64_t data_size = 0;
+	for (SparseRegion const &r : regions) {
+		map += std::to_string(r.offset) + '\n' + std::to_string(r.length) + '\n';
+		data_size += r.length;
+	}
+	map.resize((map.size() + 511) / 512 * 512, 0);
+
+	std::string pax;
+	append_pax_record(&pax, "GNU.sparse.major", "1");
+	append_pax_record(&pax, "GNU.sparse.minor", "0");
+	append_pax_record(&pax, "GNU.sparse.name", filename);
+	append_pax_record(&pax, "GNU.sparse.realsize", std::to_string(size));
+
+	// Readers without sparse support extract the raw content under this name
+	std::string name = filename;
+	auto slash = name.find_last_of('/');
+	name.insert(slash == std::string::npos ? 0 : slash + 1, "GNUSparseFile.0/");
+	name.resize(std::min(name.size(), (size_t)100));
+
+	// GNU tar applies sparse records only to POSIX headers
+	HeaderInfo info;
+	info.name = name;
+	set_owner(&info);
+	info.mode = 0644;
+	info.mtime = mtime;
+	info.typeflag = REGTYPE;
+	info.posix = true;
+	info.size = map.size() + data_size;
+	if (entry_fn_) {
+		begin_entry(info, filename, size, 512 + (pax.size() + 511) / 512 * 512 + 512 + (info.size + 511) / 512 * 512);
+	}
+
+	HeaderInfo ext;
+	ext.name = "././@PaxHeader";
+	ext.uname = "root";
+	ext.gname = "root";
+	ext.mode = 0644;
+	ext.mtime = mtime;
+	ext.typeflag = PAXTYPE;
+	ext.posix = true;
+	ext.size = pax.size();
+	write_header(ext);
+	write_content(pax.data(), pax.size());
+	write_header(info);
+	write(map.data(), (int)map.size());
+
+	bool ok = true;
+	for (SparseRegion const &r : regions) {
+		if (r.length == 0) continue;
+		if (ok && lseek(fd, r.offset, SEEK_SET) != (off_t)r.offset) {
+			ok = false;
+		}
+		ok = write_data(filename, fd, r.length, ok) && ok;
+	}
+	write_padding(data_size);
+	progress_.bytes += size - data_size;
+	return ok;
+}
+
+/**
+ * @brief Write content read from a file descriptor, without padding
+ *
+ * Content of large files is classified as compressible or not, per chunk,
+ * and the consumer is switched between compressing and storing
+ * accordingly.
+ * @param filename Path/name of the file in the archive
+ * @param fd File descriptor to read the content from
+ * @param size Number of bytes to write
+ * @param readable false to write zeros without reading
+ * @return true if successful, false if the content could not be read completely
+ */
+bool tar::TarWriter::write_data(std::string const &filename, int fd, uint64_t size, bool readable)
+{
+	if (iobuf_.empty()) {
+		iobuf_.resize(IOBUF_SIZE);
+	}
+	// Members of compressed formats are stored as a whole, others per chunk
+	const bool classify = store_fn_ && size >= MIN_STORE_SIZE;
+	const bool compressed_format = classify && has_compressed_extension(filename);
+	bool store = false;
+	bool ok = readable;
+	uint64_t pos = 0;
+	while (pos < size) {
+		size_t n = (size_t)std::min((uint64_t)iobuf_.size(), size - pos);
+		// Small pieces are read straight into the batch
+		const bool batched = n < DIRECT_SIZE;
+		char *buf = iobuf_.data();
+		if (batched) {
+			if (batch_.size() + n > BATCH_SIZE) {
+				flush();
+			}
+			batch_.resize(batch_.size() + n);
+			buf = batch_.data() + batch_.size() - n;
+		}
+		int64_t r = 0;
+		if (ok) {
+			Stats::Scope s(stats_, Stats::Read);
+			r = ::read(fd, buf, n);
+			if (r > 0) s.bytes(r);
+		}
+		if (r < 1) {
+			// Short file: keep the entry size by writing zeros
+			ok = false;
+			memset(buf, 0, n);
+		} else if ((size_t)r < n) {
+			if (batched) {
+				batch_.resize(batch_.size() - (n - r));
+			}
+			n = (size_t)r;
+		}
+		if (classify) {
+			// A short last chunk follows the decision made for the one before
+			bool s = ok && (compressed_format || (n < MIN_STORE_SIZE ? store : is_high_entropy(buf, n)));
+			if (s != store) {
+				store = s;
+				set_store(store);
+			}
+		}
+		if (!batched) {
+			write(buf, (int)n);
+		}
+		pos += n;
+		progress_.bytes += n;
+		if (progress_fn_ && pos < size) {
+			progress_fn_(progress_);
+		}
+	}
+	if (store) {
+		set_store(false);
+	}
+	return ok;
+}
+
+/**
+ * @brief Get the directory in the archive that the files of a source directory go to
+ * @param src_dir Source directory path to archive
+ * @param dst_prefix_dir Prefix directory path in the archive
+ * @return The prefix followed by the last component of the source directory
+ */
+std::string tar::TarWriter::archive_prefix(const std::string &src_dir, const std::string &dst_prefix_dir)
+{
+	// Extract directory name from path for prefix
+	if (misc::isdir(src_dir)) {
+		std::string s = src_dir;
+		size_t n = s.size();
+		// Remove trailing slashes
+		while (n > 0) {
+			char c = s[n - 1];
+			if (c == '/' || c == '\\') {
+				// nop
+			} else {
+				s = s.substr(0, n);
+				break;
+			}
+			n--;
+		}
+		// Get last directory component
+		auto pos = s.find_last_of('/');
+		if (pos == std::string::npos) {
+			pos = s.find_last_of('\\');
+		}
+		if (pos != std::string::npos) {
+			s = s.substr(pos + 1);
+		}
+		return dst_prefix_dir.empty() ? s : (dst_prefix_dir / s);
+	}
+	return dst_prefix_dir;
+}
+
+/**
+ * @brief Archive a directory into tar format
+ * @param src_dir Source directory path to archive
+ * @param dst_prefix_dir Prefix directory path in the archive
+ * @return true if successful, false otherwise
+ */
+bool tar::TarWriter::archive(const std::string &src_dir, std::string dst_prefix_dir)
+{
+	std::vector<misc::FileItem> files;
+
+	// Scan source directory for files
+	{
+		Stats::Scope s(stats_, Stats::Scan);
+		misc::scan_files(src_dir.empty() ? "." : src_dir, "", &files);
+	}
+	return archive(files, archive_prefix(src_dir, dst_prefix_dir));
+}
+
+/**
+ * @brief Archive a list of scanned files into tar format
+ *
+ * Entries get the modification times of their source files and
+ * directories. The parent directory of every file is written before it.
+ * Further names of a file archived before (same device and inode) are
+ * written as hard link entries, and so are files with the same content
+ * as one archived before if deduplication is enabled. Files with holes
+ * are written as sparse entries. Small files are read ahead in batches
+ * through the I/O backend; their entries take the size and mtime found by
+ * the scan. Files that cannot be opened or read are reported and left
+ * out, and the archive is then incomplete. Archiving stops as soon as the
+ * writer fails.
+ * @param files Files to archive, as returned by misc::scan_files()
+ * @param dst_prefix_dir Directory in the archive that the target paths are relative to
+ * @return true if every file was archived, false otherwise
+ */
+bool tar::TarWriter::archive(std::vector<misc::FileItem> const &files, std::string const &dst_prefix_dir)
+{
+	Stats::Scope scope(stats_, Stats::Tar);
+	bool ok = true;
+	std::set<std::string> dirs;
+
+	progress_.files_total += files.size();
+	for (misc::FileItem const &item : files) {
+		progress_.bytes_total += item.size;
+	}
+
+	// Files archived so far, by (dev, inode) and by (size, content hash)
+	std::map<std::pair<uint64_t, uint64_t>, std::string> inodes;
+	std::map<std::pair<uint64_t, uint64_t>, std::pair<std::string, std::string const *>> contents; // archive path, source path
+	// Only files sharing their size with another file are hashed
+	std::unordered_map<uint64_t, uint32_t> sizes;
+	std::vector<SparseRegion> regions;
+	if (dedup_) {
+		for (misc::FileItem const &item : files) {
+			if (item.size >= MIN_DEDUP_SIZE) {
+				sizes[item.size]++;
+			}
+		}
+	}
+
+	// Runs of small files are read ahead in batches
+	std::unique_ptr<io::Backend> backend = io::Backend::create(io_type_);
+	std::vector<io::FileOp> ahead;
+	std::vector<char> ahead_data;
+	size_t ahead_begin = 0;
+	auto read_ahead = [&](misc::FileItem const &item){
+		return item.size < READ_AHEAD_FILE_SIZE && item.nlink == 1;
+	};
+	// Large files coming next, opened early for the kernel readahead and read through the same descriptors
+	std::deque<std::pair<size_t, int>> prefetched;
+	size_t prefetch = 0;
+
+	// Process each file
+	for (size_t index = 0; index < files.size(); index++) {
+		misc::FileItem const &item = files[index];
+		// Nothing more can be archived once the writer has failed
+		if (write_failed_) {
+			ok = false;
+			break;
+		}
+		if (readahead_) {
+			// Files that were not read, such as other names of archived files
+			while (!prefetched.empty() && prefetched.front().first < index) {
+				close(prefetched.front().second);
+				prefetched.pop_front();
+			}
+			prefetch = std::max(prefetch, index + 1);
+			while (prefetch < files.size() && prefetched.size() - (!prefetched.empty() && prefetched.front().first == index) < READAHEAD_FILES) {
+				misc::FileItem const &next = files[prefetch++];
+				// Small files are read in batches anyway
+				if (next.size < READ_AHEAD_FILE_SIZE) continue;
+				Stats::Scope s(stats_, Stats::Read);
+				int pfd = open(next.source_path.c_str(), O_RDONLY | O_BINARY);
+				if (pfd != -1) {
+					posix_fadvise(pfd, 0, (off_t)std::min(next.size, READAHEAD_WINDOW), POSIX_FADV_WILLNEED);
+					prefetched.emplace_back(prefetch - 1, pfd);
+				}
+			}
+		}
+		// Build target path with prefix
+		std::string path = item.target_path;
+		if (!dst_prefix_dir.empty()) {
+			path = dst_prefix_dir / path;
+		}
+		// Create parent directories as needed
+		{
+			auto pos = path.find_last_of('/');
+			if (pos != std::string::npos) {
+				std::string dir = path.substr(0, pos) / "";
+				auto it = dirs.find(dir);
+				if (it == dirs.end()) {
+					if (verbose_) {
+						fprintf(stderr, " dir: %s\n", dir.c_str());
+					}
+					dirs.insert(dirs.end(), dir);
+					// The source of the directory is the one holding the file
+					uint64_t mtime = DEFAULT_MTIME;
+					auto sep = item.source_path.find_last_of("/\\");
+					struct stat dst;
+					if (sep != std::string::npos && stat(item.source_path.substr(0, sep).c_str(), &dst) == 0) {
+						mtime = (uint64_t)std::max((int64_t)dst.st_mtime, (int64_t)0);
+					}
+					write_content(dir, nullptr, 0, mtime);
+				}
+			}
+		}
+
+		// Another name of a file archived before: no need to read it
+		const std::pair<uint64_t, uint64_t> inode(item.dev, item.ino);
+		if (item.nlink > 1) {
+			auto it = inodes.find(inode);
+			if (it != inodes.end()) {
+				if (verbose_) {
+					fprintf(stderr, "link: %s -> %s\n", path.c_str(), it->second.c_str());
+				}
+				write_link(path, it->second, (uint64_t)std::max(item.mtime / 1000000000, (int64_t)0));
+				progress_.bytes += item.size;
+				progress_.files++;
+				if (progress_fn_) {
+					progress_fn_(progress_);
+				}
+				continue;
+			}
+		}
+
+		// Read the next run of small files, unless this one was read already
+		io::FileOp const *op = nullptr;
+		if (read_ahead(item)) {
+			if (index >= ahead_begin + ahead.size()) {
+				ahead_begin = index;
+				ahead.clear();
+				size_t bytes = 0;
+				for (size_t i = index; i < files.size() && read_ahead(files[i]) && ahead.size() < READ_AHEAD_FILES && bytes < READ_AHEAD_SIZE; i++) {
+					ahead.emplace_back();
+					ahead.back().path = files[i].source_path.c_str();
+					ahead.back().len = files[i].size;
+					ahead.back().drop_cache = drop_cache_;
+					bytes += files[i].size;
+				}
+				// Zero-filled, so that files which shrank are padded with zeros
+				ahead_data.assign(bytes, 0);
+				bytes = 0;
+				for (io::FileOp &a : ahead) {
+					a.data = ahead_data.data() + bytes;
+					bytes += a.len;
+				}
+				Stats::Scope s(stats_, Stats::Read);
+				backend->read_files(ahead.data(), ahead.size());
+				for (io::FileOp const &a : ahead) {
+					if (a.result > 0) s.bytes(a.result);
+				}
+			}
+			op = &ahead[index - ahead_begin];
+		}
+
+		// Open source file
+		int fd = -1;
+		bool stat_ok = true;
+		uint64_t size = item.size;
+		uint64_t mtime = (uint64_t)std::max(item.mtime / 1000000000, (int64_t)0);
+		bool sparse = false;
+		if (op) {
+			if (!op->opened) {
+				fprintf(stderr, "error: failed to open the file: %s\n", item.source_path.c_str());
+				ok = false;
+				continue;
+			}
+		} else {
+			struct stat st;
+			{
+				Stats::Scope s(stats_, Stats::Read);
+				if (!prefetched.empty() && prefetched.front().first == index) {
+					fd = prefetched.front().second;
+					prefetched.pop_front();
+				} else {
+					fd = open(item.source_path.c_str(), O_RDONLY | O_BINARY);
+				}
+				stat_ok = fd != -1 && fstat(fd, &st) == 0;
+			}
+			if (fd == -1) {
+				fprintf(stderr, "error: failed to open the file: %s\n", item.source_path.c_str());
+				ok = false;
+				continue;
+			}
+			if (stat_ok) {
+				if (readahead_) {
+					posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+				}
+				size = st.st_size;
+				mtime = (uint64_t)std::max((int64_t)st.st_mtime, (int64_t)0);
+				// Holes are skipped rather than read
+				Stats::Scope s(stats_, Stats::Read);
+				sparse = find_data_regions(fd, st, MIN_HOLE_SIZE, &regions);
+			}
+		}
+
+		if (stat_ok) {
+			// A copy of the content of a file archived before
+			std::pair<uint64_t, uint64_t> content;
+			bool hashed = false;
+			std::string const *same = nullptr;
+			if (dedup_ && !sparse && size == item.size && sizes[item.size] > 1) {
+				content.first = item.size;
+				if (op) {
+					hashed = op->result == (int64_t)size;
+					content.second = XXH64(op->data, size, 0);
+				} else {
+					hashed = hash_file(fd, item.size, &content.second);
+				}
+				if (hashed) {
+					// A hash match is confirmed by comparing the bytes
+					auto it = contents.find(content);
+					if (it != contents.end() && same_content(fd, op ? op->data : nullptr, *it->second.second, size)) {
+						same = &it->second.first;
+					}
+				}
+			}
+			if (same) {
+				if (verbose_) {
+					fprintf(stderr, "link: %s -> %s\n", path.c_str(), same->c_str());
+				}
+				write_link(path, *same, mtime);
+				progress_.bytes += item.size;
+			} else {
+				if (verbose_) {
+					fprintf(stderr, "file: %s\n", path.c_str());
+				}
+				scope.bytes(size);
+				bool written;
+				if (op) {
+					write_content(path, op->data, size, mtime);
+					progress_.bytes += size;
+					written = op->result == (int64_t)size;
+				} else {
+					// Stream file content into the tar archive
+					written = sparse ? write_sparse_file(path, fd, size, mtime, regions) : write_file(path, fd, size, mtime);
+				}
+				if (written) {
+					if (item.nlink > 1) {
+						inodes.emplace(inode, path);
+					}
+					if (hashed) {
+						contents.emplace(content, std::make_pair(path, &item.source_path));
+					}
+				} else {
+					fprintf(stderr, "error: failed read from the file: %s\n", item.source_path.c_str());
+					ok = false;
+				}
+			}
+		} else {
+			fprintf(stderr, "error: failed to stat the file: %s\n", item.source_path.c_str());
+			ok = false;
+		}
+		if (fd != -1) {
+			if (drop_cache_) {
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			}
+			close(fd);
+		}
+		progress_.files++;
+		if (progress_fn_) {
+			progress_fn_(progress_);
+		}
+	}
+	for (auto const &p : prefetched) {
+		close(p.second);
+	}
+
+	// Write end-of-archive marker
+	if (!finish()) {
+		ok = false;
+	}
+
+	return ok;
+}
+
+
+
+/**
+ * @brief Check that a member path stays within the destination directory
+ * @param path Path in the archive
+ * @return false if the path is empty or absolute, or has a ".." component
+ */
+bool tar::is_safe_path(std::string_view path)
+{
+	if (path.empty() || path[0] == '/' || path[0] == '\\') return false;
+	size_t pos = 0;
+	while (pos <= path.size()) {
+		size_t end = path.find_first_of("/\\", pos);
+		if (end == std::string_view::npos) end = path.size();
+		if (path.substr(pos, end - pos) == "..") return false;
+		pos = end + 1;
+	}
+	return true;
+}
+
+/**
+ * @brief Match a name against a shell wildcard pattern
+ *
+ * Supports '*', '?', bracket expressions and backslash escapes. As in GNU
+ * tar, wildcards also match '/'.
+ * @param pattern Wildcard pattern
+ * @param name Name to match
+ * @return true if the name matches
+ */
+static bool glob_match(char const *pattern, std::string_view name)
+{
+	char const *star = nullptr;
+	size_t resume = 0;
+	size_t pos = 0;
+	while (pos < name.size()) {
+		bool ok = false;
+		char const *p = pattern;
+		if (*p == '*') {
+			star = ++pattern;
+			resume = pos;
+			continue;
+		}
+		if (*p == '?') {
+			ok = true;
+			p++;
+		} else if (*p == '[') {
+			p++;
+			bool negate = (*p == '!' || *p == '^');
+			if (negate) p++;
+			bool hit = false;
+			bool first = true;
+			while (*p && (first || *p != ']')) {
+				first = false;
+				unsigned char lo = *p++;
+				unsigned char hi = lo;
+				if (*p == '-' && p[1] && p[1] != ']') {
+					hi = p[1];
+					p += 2;
+				}
+				if ((unsigned char)name[pos] >= lo && (unsigned char)name[pos] <= hi) {
+					hit = true;
+				}
+			}
+			if (*p == ']') {
+				p++;
+				ok = (hit != negate);
+			}
+		} else {
+			if (*p == '\\' && p[1]) p++;
+			ok = (*p && *p == name[pos]);
+			if (*p) p++;
+		}
+		if (ok) {
+			pattern = p;
+			pos++;
+		} else if (star) {
+			// Let the last '*' absorb one more character
+			pattern = star;
+			pos = ++resume;
+		} else {
+			return false;
+		}
+	}
+	while (*pattern == '*') pattern++;
+	return *pattern == 0;
+}
+
+/**
+ * @brief Strip a leading "./" and trailing slashes from a member path
+ * @param path Member path
+ * @return Normalized path (a view into path)
+ */
+static std::string_view normalize_member(std::string_view path)
+{
+	while (path.size() > 2 && path[0] == '.' && path[1] == '/') {
+		path.remove_prefix(2);
+	}
+	while (path.size() > 1 && path.back() == '/') {
+		path.remove_suffix(1);
+	}
+	return path;
+}
+
+/**
+ * @brief Constructor for MemberFilter
+ *
+ * A pattern selects the members it matches and, if it names a directory,
+ * everything below it.
+ * @param patterns Member paths or wildcard patterns
+ */
+tar::MemberFilter::MemberFilter(std::vector<std::string> const &patterns)
+{
+	for (std::string const &s : patterns) {
+		Pattern p;
+		p.text = std::string(normalize_member(s));
+		p.wildcard = p.text.find_first_of("*?[\\") != std::string::npos;
+		if (p.wildcard) {
+			p.subtree = p.text + "/*";
+			wildcards_ = true;
+		} else {
+			literals_++;
+		}
+		patterns_.push_back(p);
+	}
+}
+
+/**
+ * @brief Check whether the filter has no patterns (selects everything)
+ */
+bool tar::MemberFilter::empty() const
+{
+	return patterns_.empty();
+}
+
+/**
+ * @brief Check whether a member is selected, and record the match
+ * @param path Member path
+ * @param typeflag Type of the member
+ * @return true if the member is selected
+ */
+bool tar::MemberFilter::match(std::string_view path, char typeflag)
+{
+	if (patterns_.empty()) return true;
+	const std::string_view name = normalize_member(path);
+	const bool isdir = typeflag == '5' || (!path.empty() && path.back() == '/');
+	bool selected = false;
+	for (Pattern &p : patterns_) {
+		bool hit;
+		if (p.wildcard) {
+			hit = glob_match(p.text.c_str(), name) || glob_match(p.subtree.c_str(), name);
+		} else if (name == p.text) {
+			hit = true;
+			if (!isdir && !p.complete) {
+				p.complete = true;
+				complete_++;
+			}
+		} else {
+			hit = name.size() > p.text.size() && name[p.text.size()] == '/' && name.substr(0, p.text.size()) == p.text;
+		}
+		if (hit) {
+			p.matched = true;
+			selected = true;
+		}
+	}
+	return selected;
+}
+
+/**
+ * @brief Check whether no further member can be selected
+ *
+ * This is the case when there are no wildcard patterns and every path has
+ * been found as a file. Paths naming directories keep the filter open,
+ * since their contents may follow anywhere in the archive.
+ */
+bool tar::MemberFilter::done() const
+{
+	return !patterns_.empty() && !wildcards_ && complete_ == literals_;
+}
+
+/**
+ * @brief Get the patterns that did not match any member
+ */
+std::vector<std::string> tar::MemberFilter::missing() const
+{
+	std::vector<std::string> out;
+	for (Pattern const &p : patterns_) {
+		if (!p.matched) {
+			out.push_back(p.text);
+		}
+	}
+	return out;
+}
+
+/**
+ * @brief Read data from tar archive
+ * @param ptr Buffer to read data into
+ * @param len Length of data to read
+ * @return Number of bytes read
+ */
+int tar::TarReader::read(char *ptr, int len)
+{
+	return reader_(ptr, len);
+}
+
+/**
+ * @brief Discard data from tar archive
+ * @param len Number of bytes to discard
+ * @return true if successful, false otherwise
+ */
+bool tar::TarReader::skip(uint64_t len)
+{
+	if (skipper_) {
+		return skipper_(len);
+	}
+	if (buf_.empty()) {
+		buf_.resize(BUF_SIZE);
+	}
+	while (len > 0) {
+		int n = (int)std::min(len, (uint64_t)buf_.size());
+		if (read(buf_.data(), n) != n) return false;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * @brief Constructor for TarReader
+ * @param reader Callback function for reading data
+ */
+tar::TarReader::TarReader(std::function<int (char *, int)> reader)
+	: reader_(reader)
+{
+	memset(header_, 0, sizeof(header_));
+}
+
+/**
+ * @brief Set a callback used to discard data instead of reading it
+ *
+ * Without a skipper, skipped content is read into a scratch buffer.
+ * @param fn Callback function discarding the given number of bytes
+ */
+void tar::TarReader::set_skipper(std::function<bool (uint64_t len)> fn)
+{
+	skipper_ = fn;
+}
+
+/**
+ * @brief Set the I/O backend that the writer threads of extract() create files with
+ * @param type Backend type
+ */
+void tar::TarReader::set_io_backend(io::Backend::Type type)
+{
+	io_type_ = type;
+}
+
+/**
+ * @brief Mark the extraction as covering only some of the members
+ *
+ * Hard links to members that were not extracted are then not made;
+ * unresolved_links() lists them instead. Extraction with a filter is
+ * always partial.
+ * @param partial true if only some members are extracted
+ */
+void tar::TarReader::set_partial(bool partial)
+{
+	partial_ = partial;
+}
+
+/**
+ * @brief Extract members only as the contents of links to them
+ *
+ * Completes a partial extraction: the content of each member is written
+ * under the first of the given link names, and the other names are made
+ * hard links to it. The member itself and all other entries are skipped.
+ * @param sources Link names by member path, as listed by unresolved_links()
+ */
+void tar::TarReader::set_link_sources(std::map<std::string, std::vector<std::string>> sources)
+{
+	link_sources_ = std::move(sources);
+}
+
+/**
+ * @brief Get the hard links of a partial extraction whose targets were not extracted
+ * @return Link names and the paths of the members they refer to
  */
-int tar::TarWriter::write(const char *ptr, int len)
+std::vector<std::pair<std::string, std::string>> const &tar::TarReader::unresolved_links() const
 {
-	return writer_(ptr, len);
+	return unresolved_;
 }
 
 /**
- * @brief Write a tar header for a file or directory
- * @param data Tar data structure containing file metadata
+ * @brief Set the statistics to record the write stage of extraction into
+ * @param stats Statistics (nullptr: none)
  */
-void tar::TarWriter::write_header(const TarData &data)
+void tar::TarReader::set_stats(Stats *stats)
 {
-	char tmp[512];
-	memset(tmp, 0, sizeof(tmp));
-	TarHeader *h = (TarHeader *)tmp;
-	// Copy filename (max 100 bytes)
-	memcpy(h->name, data.filename.c_str(), std::min(100, (int)data.filename.size()));
-	// Format metadata fields in octal
-	sprintf(h->mode, "%07o", data.mode);
-	sprintf(h->uid, "%07o", data.uid);
-	sprintf(h->gid, "%07o", data.gid);
-	sprintf(h->size, "%011o", data.length);
-	sprintf(h->mtime, "%011o", 014202150465);
-	memset(h->chksum, ' ', 8);
-	h->typeflag[0] = data.typeflag;
-	// Set POSIX tar format (ustar)
-	strncpy(h->magic, "ustar ", sizeof(h->magic));
-	strncpy(h->version, " ", sizeof(h->version));
-	strncpy(h->uname, data.uname.c_str(), sizeof(h->uname));
-	strncpy(h->gname, data.gname.c_str(), sizeof(h->gname));
-
-	// Calculate checksum
-	uint sum = 0;
-	for (int i = 0; i < 512; i++) {
-		sum += tmp[i];
-	}
-	sprintf(h->chksum, "%06o", sum);
-
-	// Write header block
-	write(tmp, 512);
+	stats_ = stats;
 }
 
 /**
- * @brief Write file content to tar archive with padding
- * @param ptr Pointer to content data
- * @param len Length of content
+ * @brief Enable printing every extracted file and directory to stderr
+ * @param verbose true to print
  */
-void tar::TarWriter::write_content(const char *ptr, size_t len)
+void tar::TarReader::set_verbose(bool verbose)
 {
-	if (ptr && len > 0) {
-		int offset = 0;
-		while (offset < len) {
-			int n = (int)len - offset;
-			if (n > 512) {
-				n = 512;
-			}
-			write(ptr + offset, n);
-			// Pad to 512-byte boundary
-			if (n < 512) {
-				char tmp[512];
-				memset(tmp, 0, sizeof(tmp));
-				write(tmp, 512 - n);
-			}
-			offset += n;
-		}
-	}
+	verbose_ = verbose;
 }
 
 /**
- * @brief Write end-of-archive marker (two zero blocks)
+ * @brief Set a callback function reporting extraction progress
+ *
+ * It is called after every extracted file and, for large files, after
+ * every chunk. Totals are not known to the reader and are left 0.
+ * @param fn Callback function
  */
-void tar::TarWriter::write_end()
+void tar::TarReader::set_progress_callback(std::function<void (Progress const &progress)> fn)
 {
-	char tmp[1024];
-	memset(tmp, 0, 1024);
-	write(tmp, 1024);
+	progress_fn_ = fn;
 }
 
 /**
- * @brief Constructor for TarWriter
- * @param writer Callback function for writing data
+ * @brief Check whether reading failed because of a broken or truncated archive
+ * @return true if an error occurred
  */
-tar::TarWriter::TarWriter(std::function<int (const char *, int)> writer)
-	: writer_(writer)
+bool tar::TarReader::failed() const
 {
+	return failed_;
 }
 
 /**
- * @brief Finalize the tar archive
+ * @brief Check whether the end-of-archive marker has been read
  */
-void tar::TarWriter::finish()
+bool tar::TarReader::at_end() const
 {
-	write_end();
+	return end_;
 }
 
 /**
- * @brief Write a file or directory entry to tar archive
- * @param filename Path/name of the file or directory
- * @param content_begin Pointer to file content (nullptr for directories)
- * @param content_length Length of file content (0 for directories)
+ * @brief Read and parse one header block
+ * @param info Output header fields, with views into the header buffer
+ * @param end Set to true at the end-of-archive marker
+ * @return true if successful, false otherwise
  */
-void tar::TarWriter::write_content(const std::string &filename, const char *content_begin, int content_length)
+bool tar::TarReader::read_header(HeaderInfo *info, bool *end)
 {
-	if (filename.empty()) return;
+	*info = {};
+	*end = false;
+	pending_ = 0;
+	length_ = 0;
 
-	// Handle long filenames (>100 chars) with GNU tar extension
-	if (filename.size() > 100) {
-		TarData data;
-		data.filename = "././@LongLink";
-		data.uname = "root";
-		data.gname = "root";
-		data.uid = 0;
-		data.gid = 0;
-		data.typeflag = LONGLINKTYPE;
-		data.content = filename.c_str();
-		data.length = (int)filename.size() + 1;
-		write_header(data);
-		write_content(data.content, data.length);
+	if (read(header_, 512) != 512) {
+		fprintf(stderr, "error: failed to read from the tar archive\n");
+		return false;
 	}
-	{
-		TarData data;
-		data.filename = filename;
-		data.uname = "nobody";
-		data.gname = "nogroup";
-		data.uid = 65534;
-		data.gid = 65534;
-		// Check if it's a directory or regular file
-		if (filename[filename.size() - 1] == '/') {
-			data.mode = 0755;
-			data.typeflag = DIRTYPE;
-		} else {
-			data.mode = 0644;
-			data.typeflag = REGTYPE;
-			data.content = content_begin;
-			data.length = content_length;
-		}
-		write_header(data);
-		write_content(data.content, data.length);
+	if (header_[0] == 0) { // End of archive
+		*end = true;
+		return true;
+	}
+	if (!decode_header(header_, info)) {
+		fprintf(stderr, "error: checksum incorrect\n");
+		return false;
+	}
+
+	// Directories, links and devices carry no content
+	switch (info->typeflag) {
+	case LNKTYPE:
+	case SYMTYPE:
+	case CHRTYPE:
+	case BLKTYPE:
+	case DIRTYPE:
+	case FIFOTYPE:
+		break;
+	default:
+		length_ = info->size;
+		pending_ = (length_ + 511) / 512 * 512;
+		break;
 	}
+	return true;
 }
 
 /**
- * @brief Archive a directory into tar format
- * @param src_dir Source directory path to archive
- * @param dst_prefix_dir Prefix directory path in the archive
- * @return true if successful, false otherwise
+ * @brief Advance to the next entry
+ *
+ * Unread content of the previous entry is skipped. Extension headers (GNU
+ * long names and link names, and PAX records) and the ustar name prefix
+ * are applied to the returned entry. Long names are kept in buffers owned by the reader, so
+ * after the first few entries no memory is allocated.
+ * @param info Output header fields of the entry, valid until the next call
+ * @return true if an entry was read, false at the end of the archive or on error
  */
-bool tar::TarWriter::archive(const std::string &src_dir, std::string dst_prefix_dir)
+bool tar::TarReader::next(HeaderInfo *info)
 {
-	bool ok = true;
+	if (failed_) return false;
 
-	// Extract directory name from path for prefix
-	if (misc::isdir(src_dir)) {
-		std::string s = src_dir;
-		size_t n = s.size();
-		// Remove trailing slashes
-		while (n > 0) {
-			char c = s[n - 1];
-			if (c == '/' || c == '\\') {
-				// nop
-			} else {
-				s = s.substr(0, n);
-				break;
+	// Skip whatever is left of the previous entry
+	if (!skip_content()) return false;
+
+	bool end = false;
+	if (!read_header(info, &end)) {
+		failed_ = true;
+		return false;
+	}
+	if (end) {
+		end_ = true;
+		return false;
+	}
+
+	// Handle extension headers preceding the actual file header: GNU tar
+	// long filename (L) and link name (K), PAX extended (x) and global (g) headers
+	bool has_longname = false;
+	bool has_pax_path = false;
+	bool has_linkname = false;
+	bool has_sparse_name = false;
+	int sparse_major = -1;
+	uint64_t sparse_realsize = (uint64_t)-1;
+	uint64_t pax_size = (uint64_t)-1;
+	while (info->typeflag == 'L' || info->typeflag == 'K' || info->typeflag == 'x' || info->typeflag == 'g') {
+		ext_.clear();
+		if (!read_content([&](char const *ptr, int len){
+			int n = std::min(len, PATH_MAX + 4096 - (int)ext_.size());
+			ext_.insert(ext_.end(), ptr, ptr + n);
+			return len;
+		})) {
+			return false;
+		}
+		if (info->typeflag == 'L') {
+			longname_.assign(field_view(ext_.data(), ext_.size()));
+			has_longname = true;
+		} else if (info->typeflag == 'K') {
+			linkname_.assign(field_view(ext_.data(), ext_.size()));
+			has_linkname = true;
+		} else if (info->typeflag == 'x') {
+			// Records: "<length> <key>=<value>\n"
+			std::string_view ext(ext_.data(), ext_.size());
+			while (!ext.empty()) {
+				size_t reclen = 0;
+				size_t i = 0;
+				while (i < ext.size() && ext[i] >= '0' && ext[i] <= '9') {
+					reclen = reclen * 10 + (ext[i] - '0');
+					i++;
+				}
+				if (i == 0 || reclen <= i + 1 || reclen > ext.size() || ext[i] != ' ') break;
+				std::string_view rec = ext.substr(i + 1, reclen - i - 2);
+				auto eq = rec.find('=');
+				if (eq != std::string_view::npos) {
+					std::string_view key = rec.substr(0, eq);
+					std::string_view value = rec.substr(eq + 1);
+					auto Number = [](std::string_view s){
+						uint64_t n = 0;
+						for (char c : s) {
+							if (c < '0' || c > '9') break;
+							n = n * 10 + (c - '0');
+						}
+						return n;
+					};
+					if (key == "path" && !has_sparse_name) {
+						paxpath_.assign(value);
+						has_pax_path = true;
+					} else if (key == "GNU.sparse.name") {
+						// Real name of a sparse file, which takes precedence
+						paxpath_.assign(value);
+						has_pax_path = true;
+						has_sparse_name = true;
+					} else if (key == "GNU.sparse.major") {
+						sparse_major = (int)Number(value);
+					} else if (key == "GNU.sparse.realsize") {
+						sparse_realsize = Number(value);
+					} else if (key == "linkpath") {
+						linkname_.assign(value);
+						has_linkname = true;
+					} else if (key == "size") {
+						pax_size = Number(value);
+					}
+				}
+				ext.remove_prefix(reclen);
 			}
-			n--;
 		}
-		// Get last directory component
-		auto pos = s.find_last_of('/');
-		if (pos == std::string::npos) {
-			pos = s.find_last_of('\\');
+
+		// Read the actual file header
+		if (!read_header(info, &end)) {
+			failed_ = true;
+			return false;
 		}
-		if (pos != std::string::npos) {
-			s = s.substr(pos + 1);
+		if (end) {
+			fprintf(stderr, "error: unexpected end of archive\n");
+			failed_ = true;
+			return false;
 		}
-		dst_prefix_dir = dst_prefix_dir.empty() ? s : (dst_prefix_dir / s);
 	}
-
-	std::set<std::string> dirs;
-	std::vector<misc::FileItem> files;
-
-	// Scan source directory for files
-	std::string srcdir = src_dir;
-	if (srcdir.empty()) {
-		srcdir = ".";
+	if (has_pax_path) {
+		info->name = paxpath_;
+	} else if (has_longname) {
+		info->name = longname_;
+	} else {
+		// POSIX ustar: the name continues the prefix field
+		TarHeader const *h = (TarHeader const *)header_;
+		if (memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0] != 0) {
+			longname_.assign(field_view(h->prefix, sizeof(h->prefix)));
+			longname_ += '/';
+			longname_ += info->name;
+			info->name = longname_;
+		}
 	}
-	misc::scan_files(srcdir, "", &files);
-
-	// Process each file
-	for (misc::FileItem const &item : files) {
-		// Open source file
-		int fd = open(item.source_path.c_str(), O_RDONLY | O_BINARY);
-		if (fd == -1) {
-			fprintf(stderr, "error: failed to open the file: %s\n", item.source_path.c_str());
-			break;
+	if (has_linkname) {
+		info->linkname = linkname_;
+	}
+	if (pax_size != (uint64_t)-1) {
+		info->size = pax_size;
+		length_ = pax_size;
+		pending_ = (length_ + 511) / 512 * 512;
+	}
+	// PAX 1.0 sparse files: the content starts with the map of data regions
+	sparse_.clear();
+	if (sparse_major == 1 && sparse_realsize != (uint64_t)-1 && (info->typeflag == REGTYPE || info->typeflag == AREGTYPE)) {
+		if (!read_sparse_map(sparse_realsize)) {
+			fprintf(stderr, "error: broken sparse map\n");
+			failed_ = true;
+			return false;
 		}
+		info->size = sparse_realsize;
+		info->sparse = true;
+	}
+	return true;
+}
 
-		// Build target path with prefix
-		std::string path = item.target_path;
-		if (!dst_prefix_dir.empty()) {
-			path = dst_prefix_dir / path;
-		}
-		// Create parent directories as needed
-		{
-			auto pos = path.find_last_of('/');
-			if (pos != std::string::npos) {
-				std::string dir = path.substr(0, pos) / "";
-				auto it = dirs.find(dir);
-				if (it == dirs.end()) {
-					fprintf(stderr, " dir: %s\n", dir.c_str());
-					dirs.insert(dirs.end(), dir);
-					write_content(dir, nullptr, 0);
-				}
-			}
-		}
-		fprintf(stderr, "file: %s\n", path.c_str());
-		struct stat st;
-		if (fstat(fd, &st) == 0) {
-			// Read entire file into memory
-			std::unique_ptr<char> arr(new char [st.st_size]);
-			int64_t pos = 0;
-			while (pos < st.st_size) {
-				int n = (int)std::min((long)4096, (long)st.st_size - (long)pos);
-				if (read(fd, arr.get() + pos, n) != n) {
-					fprintf(stderr, "error: failed read from the file: %s\n", item.source_path.c_str());
-					ok = false;
-					goto err;
-				}
-				pos += n;
+/**
+ * @brief Read the map of data regions at the start of a sparse entry
+ *
+ * The map is decimal text: the number of regions, then offset and length
+ * of each, every number followed by a newline, padded to whole blocks.
+ * Afterwards only the data regions are left of the content.
+ * @param realsize Size of the file
+ * @return false if the map is broken or does not match the content
+ */
+bool tar::TarReader::read_sparse_map(uint64_t realsize)
+{
+	char block[512];
+	size_t pos = sizeof(block);
+	auto Number = [&](uint64_t *value){
+		*value = 0;
+		int digits = 0;
+		while (1) {
+			if (pos == sizeof(block)) {
+				if (length_ < sizeof(block) || read(block, sizeof(block)) != sizeof(block)) return false;
+				length_ -= sizeof(block);
+				pending_ -= sizeof(block);
+				pos = 0;
 			}
-			// Write file to tar archive
-			write_content(path, arr.get(), (int)st.st_size);
-		} else {
-			fprintf(stderr, "error: failed to stat the file: %s\n", item.source_path.c_str());
-			ok = false;
+			const char c = block[pos++];
+			if (c == '\n') return digits > 0;
+			if (c < '0' || c > '9' || ++digits > 19) return false;
+			*value = *value * 10 + (c - '0');
 		}
-err:;
-		close(fd);
+	};
+	uint64_t count;
+	if (!Number(&count)) return false;
+	uint64_t data_size = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		SparseRegion r;
+		if (!Number(&r.offset) || !Number(&r.length)) return false;
+		if (r.offset > realsize || r.length > realsize - r.offset) return false;
+		data_size += r.length;
+		sparse_.push_back(r);
 	}
+	return data_size == length_;
+}
 
-	// Write end-of-archive marker
-	finish();
+/**
+ * @brief Get the data regions of the current entry if it is sparse
+ * @return Data regions in file order (empty if the entry is not sparse)
+ */
+std::vector<tar::SparseRegion> const &tar::TarReader::sparse_map() const
+{
+	return sparse_;
+}
 
+/**
+ * @brief Read the content of the current entry
+ *
+ * The content is read in whole 512-byte blocks, up to 1 MB at once, and
+ * passed to the writer without the padding. If the writer fails, the rest
+ * of the content is still consumed. Of sparse entries, only the data
+ * regions of sparse_map() are passed, one after another.
+ * @param writer Callback function receiving the content
+ * @return true if successful, false otherwise
+ */
+bool tar::TarReader::read_content(std::function<int (char const *ptr, int len)> const &writer)
+{
+	if (buf_.empty()) {
+		buf_.resize(BUF_SIZE);
+	}
+	bool ok = true;
+	while (pending_ > 0) {
+		int n = (int)std::min(pending_, (uint64_t)buf_.size());
+		if (read(buf_.data(), n) != n) {
+			fprintf(stderr, "error: failed to read from the tar archive\n");
+			failed_ = true;
+			return false;
+		}
+		// Write actual content (excluding padding)
+		int m = (int)std::min((uint64_t)n, length_);
+		if (ok && m > 0 && writer(buf_.data(), m) != m) {
+			ok = false;
+		}
+		length_ -= m;
+		pending_ -= n;
+	}
 	return ok;
 }
 
-
+/**
+ * @brief Skip the content of the current entry without reading it
+ * @return true if successful, false otherwise
+ */
+bool tar::TarReader::skip_content()
+{
+	if (pending_ > 0) {
+		if (!skip(pending_)) {
+			fprintf(stderr, "error: failed to read from the tar archive\n");
+			failed_ = true;
+			return false;
+		}
+		pending_ = 0;
+		length_ = 0;
+	}
+	return true;
+}
 
 /**
- * @brief Read data from tar archive
- * @param ptr Buffer to read data into
- * @param len Length of data to read
- * @return Number of bytes read
+ * @brief Iterate over the entries of the tar archive without extracting them
+ *
+ * Only headers are parsed; content is skipped.
+ * @param fn Callback function called for each entry
+ * @return true if successful, false otherwise
  */
-int tar::TarReader::read(char *ptr, int len)
+bool tar::TarReader::list(std::function<void (HeaderInfo const &info)> const &fn)
 {
-	return reader_(ptr, len);
+	HeaderInfo info;
+	while (next(&info)) {
+		fn(info);
+	}
+	return !failed_;
 }
 
 /**
- * @brief Constructor for TarReader
- * @param reader Callback function for reading data
+ * @brief Recreate a hard link entry
+ *
+ * Where a hard link cannot be made (file systems without hard links, or
+ * Windows), the target is copied instead.
+ * @param dstdir Destination directory
+ * @param name Path of the link
+ * @param target Path of the member the link refers to
+ * @return true if successful, false otherwise
  */
-tar::TarReader::TarReader(std::function<int (char *, int)> reader)
-	: reader_(reader)
+static bool extract_link(std::string const &dstdir, std::string const &name, std::string const &target)
 {
+	if (!tar::is_safe_path(name)) {
+		fprintf(stderr, "error: unsafe link path: %s\n", name.c_str());
+		return false;
+	}
+	if (!tar::is_safe_path(target)) {
+		fprintf(stderr, "error: unsafe link target: %s\n", target.c_str());
+		return false;
+	}
+	const std::string path = dstdir / name;
+	const std::string from = dstdir / target;
+	remove(path.c_str());
+#ifndef _WIN32
+	if (link(from.c_str(), path.c_str()) == 0) return true;
+#endif
+	int in = ::open(from.c_str(), O_RDONLY | O_BINARY);
+	struct stat st;
+	if (in == -1 || fstat(in, &st) != 0) {
+		fprintf(stderr, "error: failed to link %s to %s\n", name.c_str(), target.c_str());
+		if (in != -1) ::close(in);
+		return false;
+	}
+	int out = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, st.st_mode & 07777);
+	bool ok = out != -1;
+	std::vector<char> buf(1 << 20);
+	while (ok) {
+		auto n = ::read(in, buf.data(), buf.size());
+		if (n == 0) break;
+		ok = n > 0 && misc::write_fully(out, buf.data(), n);
+	}
+	if (!ok) {
+		fprintf(stderr, "error: failed to copy %s to %s\n", target.c_str(), name.c_str());
+	}
+	if (out != -1) ::close(out);
+	::close(in);
+	return ok;
 }
 
-class FileWriter {
+/**
+ * @brief Fixed-size pool of threads writing extracted files
+ *
+ * File contents are queued together with their path; the total size of
+ * queued contents is capped, and push() blocks while the cap is reached so
+ * that the tar reader cannot run ahead of the disk. Each thread takes the
+ * queued files in batches and writes them through its own I/O backend.
+ */
+class FileWriterPool {
 private:
-	int fd_ = -1;
-	std::thread th_;
-	std::vector<char> buffer_;
+	struct Job {
+		std::string path;
+		int mode = 0;
+		std::vector<char> data;
+	};
+	static constexpr size_t MAX_BATCH_FILES = 64;
+	static constexpr size_t MAX_BATCH_BYTES = 1 << 20;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<Job> queue_;
+	std::vector<std::thread> threads_;
+	Stats *stats_;
+	io::Backend::Type io_type_;
+	size_t max_bytes_;
+	size_t bytes_ = 0; // queued and in-progress bytes
+	bool quit_ = false;
+	bool failed_ = false;
 	/**
-	 * @brief Close the file descriptor
+	 * @brief Write queued files until the pool is closed (runs in worker threads)
 	 */
-	void closefile()
+	void run()
 	{
-		if (fd_ != -1) {
-			::close(fd_);
-			fd_ = -1;
+		std::unique_ptr<io::Backend> backend = io::Backend::create(io_type_);
+		std::vector<Job> jobs;
+		std::vector<io::FileOp> ops;
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (1) {
+			cond_.wait(lock, [&](){ return quit_ || !queue_.empty(); });
+			if (queue_.empty()) break;
+			// Take the next files, up to a batch
+			size_t batch_bytes = 0;
+			jobs.clear();
+			do {
+				batch_bytes += queue_.front().data.size();
+				jobs.push_back(std::move(queue_.front()));
+				queue_.pop_front();
+			} while (!queue_.empty() && jobs.size() < MAX_BATCH_FILES && batch_bytes + queue_.front().data.size() <= MAX_BATCH_BYTES);
+			lock.unlock();
+			ops.resize(jobs.size());
+			for (size_t i = 0; i < jobs.size(); i++) {
+				ops[i].path = jobs[i].path.c_str();
+				ops[i].data = jobs[i].data.data();
+				ops[i].len = jobs[i].data.size();
+				ops[i].mode = jobs[i].mode;
+			}
+			bool ok = true;
+			{
+				Stats::Scope s(stats_, Stats::Write);
+				backend->write_files(ops.data(), ops.size());
+				s.bytes(batch_bytes);
+			}
+			for (size_t i = 0; i < jobs.size(); i++) {
+				if (!ops[i].opened) {
+					fprintf(stderr, "error: failed to create file: %s\n", jobs[i].path.c_str());
+					ok = false;
+				} else if (ops[i].result != (int64_t)ops[i].len) {
+					fprintf(stderr, "error: failed to write file: %s\n", jobs[i].path.c_str());
+					ok = false;
+				}
+			}
+			lock.lock();
+			if (!ok) {
+				failed_ = true;
+			}
+			bytes_ -= batch_bytes;
+			if (stats_) stats_->buffered(Stats::WriteQueue, bytes_);
+			cond_.notify_all();
 		}
 	}
+public:
 	/**
-	 * @brief Write buffer to file (runs in separate thread)
+	 * @brief Constructor for FileWriterPool
+	 * @param nthreads Number of writer threads
+	 * @param max_bytes Maximum total size of queued file contents
+	 * @param stats Statistics to record the writes into (nullptr: none)
+	 * @param io_type I/O backend of the writer threads
 	 */
-	void run()
+	FileWriterPool(int nthreads, size_t max_bytes, Stats *stats, io::Backend::Type io_type)
+		: stats_(stats)
+		, io_type_(io_type)
+		, max_bytes_(max_bytes)
 	{
-		::write(fd_, buffer_.data(), buffer_.size());
-		closefile();
+		for (int i = 0; i < nthreads; i++) {
+			threads_.emplace_back([this](){
+				run();
+			});
+		}
 	}
-public:
-	~FileWriter()
+	~FileWriterPool()
 	{
 		close();
 	}
 	/**
-	 * @brief Open file for writing
-	 * @param path File path
-	 * @param mode File mode (permissions)
-	 * @return true if successful, false otherwise
+	 * @brief Get the maximum total size of queued file contents
 	 */
-	bool open(std::string const &path, int mode)
+	size_t max_bytes() const
 	{
-		fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
-		if (fd_ == -1) return false;
-		return true;
+		return max_bytes_;
 	}
 	/**
-	 * @brief Set data to be written
-	 * @param data Data buffer to write
+	 * @brief Queue a file to be written, waiting while the queue is full
+	 * @param path File path
+	 * @param mode File mode (permissions)
+	 * @param data File content
 	 */
-	void set(std::vector<char> const &data)
+	void push(std::string const &path, int mode, std::vector<char> &&data)
 	{
-		buffer_ = data;
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [&](){ return bytes_ == 0 || bytes_ + data.size() <= max_bytes_; });
+		bytes_ += data.size();
+		if (stats_) stats_->buffered(Stats::WriteQueue, bytes_);
+		queue_.push_back({path, mode, std::move(data)});
+		cond_.notify_all();
 	}
 	/**
-	 * @brief Close file and wait for write thread to finish
+	 * @brief Wait until all queued files are written and stop the threads
+	 * @return true if all files were written successfully
 	 */
-	void close()
+	bool close()
 	{
-		if (th_.joinable()) {
-			th_.join();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			quit_ = true;
+			cond_.notify_all();
 		}
-		closefile();
-	}
-	/**
-	 * @brief Start writing in background thread
-	 */
-	void start()
-	{
-		th_ = std::thread([this](){
-			run();
-		});
+		for (std::thread &th : threads_) {
+			th.join();
+		}
+		threads_.clear();
+		return !failed_;
 	}
 };
 
 /**
  * @brief Extract tar archive to destination directory
+ *
+ * With a filter, members that are not selected are skipped without being
+ * read, and extraction stops as soon as the filter cannot select anything
+ * more. Hard links of a partial extraction whose targets were not
+ * extracted are left to unresolved_links(). Members with absolute paths
+ * or ".." components are reported and skipped.
  * @param dstdir Destination directory path
+ * @param filter Filter selecting the members to extract (all if nullptr)
  * @return true if successful, false otherwise
  */
-bool tar::TarReader::extract(std::string dstdir)
+bool tar::TarReader::extract(std::string dstdir, MemberFilter *filter)
 {
 	if (dstdir.empty()) {
 		dstdir = ".";
 	}
 
 	std::set<std::string> dirs;
-	std::vector<std::shared_ptr<FileWriter>> fwriters;
-
-	char tmp[513];
-	memset(tmp, 0, sizeof(tmp));
-	while (1) {
-		// Lambda to read and parse tar header
-		auto ReadHeader = [&](TarData *data){
-			if (read(tmp, 512) != 512) return false;
-			if (tmp[0] == 0) return true; // End of archive
-
-			TarHeader *h = (TarHeader *)tmp;
-
-			// Parse header fields
-			data->filename = h->name;
-			data->mode = (int)strtoul(h->mode, nullptr, 8);
-			data->uname = h->uname;
-			data->gname = h->gname;
-			data->uid = (int)strtoul(h->uid, nullptr, 8);
-			data->gid = (int)strtoul(h->gid, nullptr, 8);
-			data->chksum = (int)strtoul(h->chksum, nullptr, 8);
-			data->typeflag = *h->typeflag;
-			data->length = (int)strtoul(h->size, nullptr, 8);
-
-			// Verify checksum
-			int sum = 0;
-			memset(h->chksum, ' ', 8);
-			for (int i = 0; i < 512; i++) {
-				sum += tmp[i];
-			}
-
-			if (sum != data->chksum) {
-				fprintf(stderr, "error: checksum incorrect\n");
-				return false;
-			}
-
-			return true;
-		};
-
-		TarData data;
-		if (!ReadHeader(&data)) {
-			return false;
-		}
 
-		if (tmp[0] == 0) break; // End of archive
+	// Small files are written by a pool of threads; files larger than a
+	// quarter of the queue limit are written directly by this thread
+	const int nthreads = std::max(2, std::min((int)std::thread::hardware_concurrency(), 8));
+	FileWriterPool fwriters(nthreads, 64 << 20, stats_, io_type_);
+	const size_t direct_threshold = fwriters.max_bytes() / 4;
+	bool ok_all = true;
+	// Hard links are made once the files they refer to have been written
+	std::vector<std::pair<std::string, std::string>> links;
+	// Files written by a partial extraction, which links can refer to
+	const bool partial = partial_ || filter || !link_sources_.empty();
+	std::set<std::string> extracted;
+	size_t sources_found = 0;
+	unresolved_.clear();
 
-		// Lambda to read file content from tar
-		auto ReadContent = [&](const std::function<int (char const *ptr, int len)> &writer){
-			bool ok = true;
-			int offset = 0;
-			while (offset < data.length) {
-				// Read 512-byte blocks
-				if (read(tmp, 512) != 512) {
-					fprintf(stderr, "error: failed to read from the tar archive\n");
-					return false;
+	// Create the parent directories of a member
+	auto make_parents = [&](std::string const &name){
+		auto p = name.find_last_of('/');
+		if (p != std::string::npos) {
+			std::string dir = name.substr(0, p);
+			auto it = dirs.find(dir);
+			if (it == dirs.end()) {
+				dirs.insert(dirs.end(), dir);
+				if (verbose_) {
+					fprintf(stderr, " dir: %s\n", dir.c_str());
 				}
-				int n = data.length - offset;
-				n = std::min(n, 512);
-				// Write actual content (excluding padding)
-				if (ok && writer(tmp, n) != n) {
-					ok = false;
+				if (!misc::mkdirs(dstdir / dir)) {
+					fprintf(stderr, "error: failed to make directory\n");
+					return false;
 				}
-				offset += 512;
-			}
-			return ok;
-		};
-
-		// Handle GNU tar long filename extension
-		if (data.typeflag == 'L' && data.filename == "././@LongLink") {
-			std::vector<char> vec;
-			ReadContent([&](char const *ptr, int len){
-				int n = std::min(len, PATH_MAX - (int)vec.size());
-				vec.insert(vec.end(), ptr, ptr + n);
-				return len;
-			});
-			vec.push_back(0);
-
-			// Read the actual file header
-			if (!ReadHeader(&data)) {
-				return false;
 			}
-			data.filename = vec.data();
 		}
+		return true;
+	};
 
+	HeaderInfo info;
+	while (next(&info)) {
+		const bool regular = info.typeflag == '0' || info.typeflag == 0;
+		std::vector<std::string> const *names = nullptr;
+		if (!link_sources_.empty()) {
+			// Only the contents of link targets, under the first link name
+			auto it = regular ? link_sources_.find(std::string(info.name)) : link_sources_.end();
+			if (it == link_sources_.end()) continue;
+			names = &it->second;
+			sources_found++;
+		} else if (filter && !filter->match(info.name, info.typeflag)) {
+			continue;
+		}
+		// Nothing is written outside the destination directory
+		if (!is_safe_path(info.name)) {
+			fprintf(stderr, "error: unsafe member path: %.*s\n", (int)info.name.size(), info.name.data());
+			ok_all = false;
+			continue;
+		}
 		// Extract regular files
-		if (data.typeflag == '0' || data.typeflag == 0) {
+		if (regular) {
+			TarData data;
+			data.filename = names ? names->front() : std::string(info.name);
+			data.mode = (int)info.mode;
+			data.length = info.size;
 			bool ok = true;
 			size_t n = data.filename.size();
 			// Check if it's not a directory
@@ -495,40 +2288,142 @@ bool tar::TarReader::extract(std::string dstdir)
 				}
 			}
 			if (ok) {
-				// Create parent directories
-				{
-					auto p = data.filename.find_last_of('/');
-					if (p != std::string::npos) {
-						std::string dir = data.filename.substr(0, p);
-						auto it = dirs.find(dir);
-						if (it == dirs.end()) {
-							dirs.insert(dirs.end(), dir);
-							fprintf(stderr, " dir: %s\n", dir.c_str());
-							if (!misc::mkdirs(dstdir / dir)) {
-								fprintf(stderr, "error: failed to make directory\n");
-								return false;
+				if (!make_parents(data.filename)) return false;
+				if (verbose_) {
+					fprintf(stderr, "file: %s\n", data.filename.c_str());
+				}
+				std::string path = dstdir / data.filename;
+				if (!info.sparse && (size_t)data.length <= direct_threshold) {
+					// Hand the content over to the writer pool
+					std::vector<char> content;
+					content.reserve(data.length);
+					if (!read_content([&](char const *ptr, int len){
+						content.insert(content.end(), ptr, ptr + len);
+						progress_.bytes += len;
+						return len;
+					})) {
+						return false;
+					}
+					fwriters.push(path, data.mode, std::move(content));
+				} else {
+					// Stream large and sparse files straight to disk
+					int fd;
+					{
+						Stats::Scope s(stats_, Stats::Write);
+						fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, data.mode);
+					}
+					if (fd == -1) {
+						fprintf(stderr, "error: failed to create file: %s\n", data.filename.c_str());
+						ok_all = false;
+					}
+					bool written = true;
+					// Data regions of sparse files are written at their offsets
+					std::vector<SparseRegion> const &regions = sparse_map();
+					size_t region = 0;
+					uint64_t region_pos = 0;
+					if (!read_content([&](char const *ptr, int len){
+						if (fd != -1 && written) {
+							Stats::Scope s(stats_, Stats::Write);
+							s.bytes(len);
+							if (info.sparse) {
+								for (int i = 0; i < len && written;) {
+									while (region < regions.size() && region_pos == regions[region].length) {
+										region++;
+										region_pos = 0;
+									}
+									if (region == regions.size()) break;
+									SparseRegion const &r = regions[region];
+									const int n = (int)std::min((uint64_t)(len - i), r.length - region_pos);
+									if (region_pos == 0) {
+										written = lseek(fd, r.offset, SEEK_SET) == (off_t)r.offset;
+									}
+									written = written && misc::write_fully(fd, ptr + i, n);
+									region_pos += n;
+									i += n;
+								}
+							} else {
+								written = misc::write_fully(fd, ptr, len);
 							}
 						}
+						progress_.bytes += len;
+						if (progress_fn_) {
+							progress_fn_(progress_);
+						}
+						return len;
+					})) {
+						if (fd != -1) ::close(fd);
+						return false;
+					}
+					if (info.sparse) {
+						// Holes are left unwritten, up to the real size
+						if (fd != -1 && written) {
+							Stats::Scope s(stats_, Stats::Write);
+							written = ftruncate(fd, (off_t)data.length) == 0;
+						}
+						for (SparseRegion const &r : regions) {
+							data.length -= r.length;
+						}
+						progress_.bytes += data.length;
+					}
+					if (fd != -1) {
+						if (!written) {
+							fprintf(stderr, "error: failed to write file: %s\n", data.filename.c_str());
+							ok_all = false;
+						}
+						::close(fd);
 					}
 				}
-				fprintf(stderr, "file: %s\n", data.filename.c_str());
-				// Extract file using background thread for writing
-				std::shared_ptr<FileWriter> writer = std::make_shared<FileWriter>();
-				if (writer->open(dstdir / data.filename, data.mode)) {
-					std::vector<char> data;
-					ReadContent([&](char const *ptr, int len){
-						data.insert(data.end(), ptr, ptr + len);
-						return len;
-					});
-					writer->set(data);
-					fwriters.push_back(writer);
-					writer->start();
-				} else {
-					fprintf(stderr, "error: failed to create file: %s\n", data.filename.c_str());
+				progress_.files++;
+				if (progress_fn_) {
+					progress_fn_(progress_);
+				}
+				if (partial) {
+					extracted.insert(data.filename);
+				}
+				if (names) {
+					for (size_t i = 1; i < names->size(); i++) {
+						if (!make_parents((*names)[i])) return false;
+						links.push_back({(*names)[i], names->front()});
+					}
 				}
 			}
 		}
+		if (info.typeflag == LNKTYPE && !info.name.empty() && !info.linkname.empty()) {
+			std::string name(info.name);
+			if (!make_parents(name)) return false;
+			links.push_back({name, std::string(info.linkname)});
+		}
+		if ((filter && filter->done()) || (names && sources_found == link_sources_.size())) {
+			break;
+		}
+	}
+	if (failed_) {
+		return false;
 	}
 
-	return true;
+	if (!fwriters.close()) {
+		ok_all = false;
+	}
+	for (auto const &pair : link_sources_) {
+		if (!extracted.count(pair.second.front())) {
+			for (std::string const &name : pair.second) {
+				fprintf(stderr, "error: failed to link %s to %s\n", name.c_str(), pair.first.c_str());
+			}
+			ok_all = false;
+		}
+	}
+	for (auto const &link : links) {
+		if (partial && !extracted.count(link.second)) {
+			// Refers to a member that was not selected
+			unresolved_.push_back(link);
+			continue;
+		}
+		if (verbose_) {
+			fprintf(stderr, "link: %s -> %s\n", link.first.c_str(), link.second.c_str());
+		}
+		if (!extract_link(dstdir, link.first, link.second)) {
+			ok_all = false;
+		}
+	}
+	return ok_all;
 }
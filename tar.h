@@ -1,9 +1,18 @@
 #ifndef TAR_H
 #define TAR_H
 
+#include <cstdint>
 #include <cstring>
 #include <functional>
+#include <map>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "iobackend.h"
+#include "misc.h"
+
+class Stats;
 
 namespace tar {
 
@@ -17,30 +26,172 @@ struct TarData {
 	int chksum = 0;
 	char typeflag = '0';
 	char const *content = nullptr;
-	int length = 0;
+	uint64_t length = 0;
+};
+
+struct HeaderInfo {
+	std::string_view name;
+	uint32_t mode = 0;
+	uint32_t uid = 0;
+	uint32_t gid = 0;
+	uint64_t size = 0;
+	uint64_t mtime = 0;
+	char typeflag = '0';
+	bool sparse = false; // size is the real size; content holds the regions of TarReader::sparse_map()
+	bool posix = false; // POSIX ustar magic instead of the GNU one
+	std::string_view linkname;
+	std::string_view uname;
+	std::string_view gname;
+};
+
+struct SparseRegion {
+	uint64_t offset = 0;
+	uint64_t length = 0;
 };
 
+struct Progress {
+	uint64_t files = 0;
+	uint64_t files_total = 0; // 0 if unknown
+	uint64_t bytes = 0; // content bytes
+	uint64_t bytes_total = 0; // 0 if unknown
+	double bytes_per_sec = 0; // throughput since the previous report
+	double elapsed = 0; // seconds since the start
+	bool done = false; // final report
+};
+
+void encode_header(HeaderInfo const &info, char *block);
+bool decode_header(char const *block, HeaderInfo *info);
+bool is_safe_path(std::string_view path);
+
 class TarWriter {
 private:
 	std::function<int (char const *ptr, int len)> writer_;
+	std::function<bool (TarData const &data, uint64_t size)> entry_fn_;
+	std::function<void (bool store)> store_fn_;
+	TarData entry_; // passed to entry_fn_, reused for every entry
+	static constexpr size_t IOBUF_SIZE = 1 << 20;
+	static constexpr size_t BATCH_SIZE = 256 << 10;
+	static constexpr size_t DIRECT_SIZE = 64 << 10;
+	static constexpr uint64_t MIN_STORE_SIZE = 64 << 10;
+	static constexpr uint64_t DEFAULT_MTIME = 014202150465; // entries without a source file
+	static constexpr uint64_t MIN_DEDUP_SIZE = 4 << 10;
+	static constexpr uint64_t MIN_HOLE_SIZE = 64 << 10;
+	static constexpr uint64_t READ_AHEAD_FILE_SIZE = 64 << 10; // smaller files are read in batches
+	static constexpr size_t READ_AHEAD_FILES = 256;
+	static constexpr size_t READ_AHEAD_SIZE = 4 << 20;
+	static constexpr size_t READAHEAD_FILES = 2; // large files opened ahead for the kernel readahead
+	static constexpr uint64_t READAHEAD_WINDOW = 32 << 20; // kernel readahead of each upcoming file
+	std::vector<char> iobuf_;
+	std::vector<char> batch_;
+	Stats *stats_ = nullptr;
+	bool verbose_ = false;
+	bool dedup_ = false;
+	bool drop_cache_ = false;
+	bool readahead_ = false;
+	bool write_failed_ = false;
+	io::Backend::Type io_type_ = io::Backend::Auto;
+	std::function<void (Progress const &progress)> progress_fn_;
+	Progress progress_;
 	int write(char const *ptr, int len);
-	void write_header(const TarData &data);
+	bool flush();
+	void set_store(bool store);
+	void write_header(HeaderInfo const &info);
+	void begin_entry(HeaderInfo const &info, std::string const &filename, uint64_t length, uint64_t size);
+	void write_entry_header(std::string const &filename, uint64_t content_length, uint64_t mtime, std::string const &linkname = {});
+	bool write_data(std::string const &filename, int fd, uint64_t size, bool readable = true);
+	bool hash_file(int fd, uint64_t size, uint64_t *hash);
+	bool same_content(int fd, char const *data, std::string const &other, uint64_t size);
+	void write_padding(uint64_t len);
 	void write_content(char const *ptr, size_t len);
 	void write_end();
 public:
 	TarWriter(std::function<int (const char *, int)> writer);
-	void finish();
-	void write_content(std::string const &filename, char const *content_begin, int content_length);
+	void set_entry_callback(std::function<bool (TarData const &data, uint64_t size)> fn);
+	void set_store_callback(std::function<void (bool store)> fn);
+	void set_dedup(bool dedup);
+	void set_io_backend(io::Backend::Type type);
+	void set_cache_hints(bool drop_cache, bool readahead);
+	void set_stats(Stats *stats);
+	void set_verbose(bool verbose);
+	void set_progress_callback(std::function<void (Progress const &progress)> fn);
+	size_t buffered() const;
+	bool finish();
+	void write_content(std::string const &filename, char const *content_begin, uint64_t content_length, uint64_t mtime = DEFAULT_MTIME);
+	bool write_file(std::string const &filename, int fd, uint64_t size, uint64_t mtime = DEFAULT_MTIME);
+	bool write_sparse_file(std::string const &filename, int fd, uint64_t size, uint64_t mtime, std::vector<SparseRegion> const &regions);
+	void write_link(std::string const &filename, std::string const &target, uint64_t mtime = DEFAULT_MTIME);
+	static std::string archive_prefix(std::string const &src_dir, std::string const &dst_prefix_dir);
 	bool archive(std::string const &src_dir, std::string dst_prefix_dir = {});
+	bool archive(std::vector<misc::FileItem> const &files, std::string const &dst_prefix_dir);
+};
+
+class MemberFilter {
+private:
+	struct Pattern {
+		std::string text;
+		std::string subtree; // "<text>/*" for wildcard patterns
+		bool wildcard = false;
+		bool matched = false;
+		bool complete = false; // matched a non-directory entry exactly
+	};
+	std::vector<Pattern> patterns_;
+	size_t literals_ = 0;
+	size_t complete_ = 0;
+	bool wildcards_ = false;
+public:
+	MemberFilter(std::vector<std::string> const &patterns);
+	bool empty() const;
+	bool match(std::string_view path, char typeflag);
+	bool done() const;
+	std::vector<std::string> missing() const;
 };
 
 class TarReader {
 private:
 	std::function<int (char *ptr, int len)> reader_;
+	std::function<bool (uint64_t len)> skipper_;
+	static constexpr size_t BUF_SIZE = 1 << 20;
+	std::vector<char> buf_;
+	char header_[513];
+	uint64_t pending_ = 0; // unread bytes of the current entry, including padding
+	uint64_t length_ = 0; // unread content bytes of the current entry
+	std::vector<char> ext_; // content of the current extension header
+	std::string longname_;
+	std::string paxpath_;
+	std::string linkname_;
+	std::vector<SparseRegion> sparse_;
+	Stats *stats_ = nullptr;
+	bool verbose_ = false;
+	io::Backend::Type io_type_ = io::Backend::Auto;
+	bool partial_ = false;
+	std::map<std::string, std::vector<std::string>> link_sources_;
+	std::vector<std::pair<std::string, std::string>> unresolved_;
+	std::function<void (Progress const &progress)> progress_fn_;
+	Progress progress_;
+	bool failed_ = false;
+	bool end_ = false;
 	int read(char *ptr, int len);
+	bool skip(uint64_t len);
+	bool read_header(HeaderInfo *info, bool *end);
+	bool read_sparse_map(uint64_t realsize);
 public:
 	TarReader(std::function<int (char *ptr, int len)> reader);
-	bool extract(std::string dstdir = {});
+	void set_skipper(std::function<bool (uint64_t len)> fn);
+	void set_io_backend(io::Backend::Type type);
+	void set_partial(bool partial);
+	void set_link_sources(std::map<std::string, std::vector<std::string>> sources);
+	void set_stats(Stats *stats);
+	void set_verbose(bool verbose);
+	void set_progress_callback(std::function<void (Progress const &progress)> fn);
+	std::vector<std::pair<std::string, std::string>> const &unresolved_links() const;
+	bool failed() const;
+	bool at_end() const;
+	bool next(HeaderInfo *info);
+	std::vector<SparseRegion> const &sparse_map() const;
+	bool read_content(std::function<int (char const *ptr, int len)> const &writer);
+	bool skip_content();
+	bool list(std::function<void (HeaderInfo const &info)> const &fn);
+	bool extract(std::string dstdir = {}, MemberFilter *filter = nullptr);
 };
 
 }
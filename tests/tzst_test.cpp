@@ -0,0 +1,472 @@
+#include "../joinpath.h"
+#include "../misc.h"
+#include "../tzst.h"
+#include "../zs.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <ftw.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/**
+ * @brief Content of a test file: the name repeated up to the given size
+ */
+std::string content(std::string const &name, size_t size)
+{
+	std::string s;
+	while (s.size() < size) {
+		s += name;
+		s += '\n';
+	}
+	s.resize(size);
+	return s;
+}
+
+/**
+ * @brief Write a file, creating its parent directories
+ * @return true if successful, false otherwise
+ */
+bool write_file(std::string const &path, std::string const &data)
+{
+	auto pos = path.find_last_of('/');
+	if (pos != std::string::npos && !misc::mkdirs(path.substr(0, pos))) return false;
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+	bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+	close(fd);
+	return ok;
+}
+
+/**
+ * @brief Read a whole file
+ * @param path File path
+ * @param out Output content
+ * @return false if the file could not be read
+ */
+bool read_file(std::string const &path, std::string *out)
+{
+	out->clear();
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		out->append(buf, n);
+	}
+	close(fd);
+	return n == 0;
+}
+
+/**
+ * @brief Check that a file exists and has the given content
+ */
+bool has_content(std::string const &path, std::string const &data)
+{
+	std::string s;
+	return read_file(path, &s) && s == data;
+}
+
+bool exists(std::string const &path)
+{
+	struct stat st;
+	return lstat(path.c_str(), &st) == 0;
+}
+
+/**
+ * @brief Remove a directory tree
+ */
+void remove_tree(std::string const &path)
+{
+	nftw(path.c_str(), [](char const *p, struct stat const *, int, struct FTW *){
+		return remove(p);
+	}, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * @brief Directory of one test, removed with everything below it at the end
+ */
+class TempDir {
+private:
+	std::string path_;
+public:
+	TempDir()
+	{
+		char tmpl[] = "/tmp/tzst-test-XXXXXX";
+		if (mkdtemp(tmpl)) {
+			path_ = tmpl;
+		}
+	}
+	~TempDir()
+	{
+		if (!path_.empty()) {
+			remove_tree(path_);
+		}
+	}
+	std::string const &path() const
+	{
+		return path_;
+	}
+};
+
+/**
+ * @brief Seekable archive options, with frames small enough to hold a few members each
+ */
+tzst::Option seekable_option()
+{
+	tzst::Option opt;
+	opt.zsopt.frame_size = 64 << 10;
+	return opt;
+}
+
+/**
+ * @brief Extraction of single members and patterns through the table of contents
+ */
+void test_toc_extraction()
+{
+	TempDir tmp;
+	const std::string src = tmp.path() / "src";
+	const std::string archive = tmp.path() / "a.tzst";
+	for (int i = 0; i < 20; i++) {
+		std::string name = "f" + std::to_string(i) + ".txt";
+		CHECK(write_file(src / "d" / name, content(name, 10000 + i * 3000)));
+	}
+	CHECK(write_file(src / "e" / "x.bin", content("x", 300000)));
+	CHECK(tzst::archive_tar_zst(seekable_option(), archive, src));
+
+	std::vector<tzst::Entry> toc;
+	CHECK(tzst::read_toc(archive, &toc));
+	bool found = false;
+	for (tzst::Entry const &e : toc) {
+		if (e.path == "src/d/f7.txt") {
+			found = e.size == 10000 + 7 * 3000 && e.length > e.size;
+		}
+	}
+	CHECK(found);
+
+	// A single member, from the middle of the archive
+	const std::string out = tmp.path() / "out";
+	CHECK(tzst::extract_member(tzst::Option(), archive, "src/d/f7.txt", out));
+	CHECK(has_content(out / "src/d/f7.txt", content("f7.txt", 10000 + 7 * 3000)));
+	CHECK(!exists(out / "src/d/f6.txt"));
+	CHECK(!exists(out / "src/e"));
+	CHECK(!tzst::extract_member(tzst::Option(), archive, "src/d/missing.txt", out));
+
+	// Patterns select members across frames
+	const std::string out2 = tmp.path() / "out2";
+	CHECK(tzst::extract_tar_zst(tzst::Option(), archive, out2, { "src/d/f1?.txt", "src/e" }));
+	for (int i = 0; i < 20; i++) {
+		std::string name = "f" + std::to_string(i) + ".txt";
+		CHECK(exists(out2 / "src/d" / name) == (i >= 10));
+		if (i >= 10) {
+			CHECK(has_content(out2 / "src/d" / name, content(name, 10000 + i * 3000)));
+		}
+	}
+	CHECK(has_content(out2 / "src/e/x.bin", content("x", 300000)));
+}
+
+/**
+ * @brief Set the modification time of a file, leaving its content alone
+ */
+bool touch(std::string const &path, time_t mtime)
+{
+	struct timespec times[2] = {};
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = mtime;
+	return utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+/**
+ * @brief Check whether an archive has a member
+ */
+bool has_member(std::string const &archive, std::string const &path)
+{
+	std::vector<tzst::Entry> entries;
+	CHECK(tzst::list_tar_zst(tzst::Option(), archive, &entries));
+	for (tzst::Entry const &e : entries) {
+		if (e.path == path) return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Incremental archives: changed files, deletions and touched files
+ */
+void test_snapshot()
+{
+	TempDir tmp;
+	const std::string src = tmp.path() / "src";
+	const std::string full = tmp.path() / "full.tzst";
+	const std::string incr = tmp.path() / "incr.tzst";
+	const std::string unhashed = tmp.path() / "unhashed.tzst";
+	CHECK(write_file(src / "a.txt", content("a", 5000)));
+	CHECK(write_file(src / "b.txt", content("b", 5000)));
+	CHECK(write_file(src / "c.txt", content("c", 5000)));
+	CHECK(write_file(src / "d" / "e.txt", content("e", 5000)));
+
+	tzst::Option opt;
+	opt.snapshot = tmp.path() / "snap";
+	opt.snapshot_hash = true;
+	CHECK(tzst::archive_tar_zst(opt, full, src));
+	CHECK(has_member(full, "src/a.txt"));
+	CHECK(has_member(full, "src/d/e.txt"));
+	tzst::Option plain;
+	plain.snapshot = tmp.path() / "snap-unhashed";
+	CHECK(tzst::archive_tar_zst(plain, unhashed, src));
+
+	// b is deleted, c changes, and a is touched without changing
+	CHECK(remove((src / "b.txt").c_str()) == 0);
+	CHECK(remove((src / "d" / "e.txt").c_str()) == 0);
+	CHECK(write_file(src / "c.txt", content("c2", 6000)));
+	CHECK(touch(src / "a.txt", time(nullptr) + 3600));
+	CHECK(tzst::archive_tar_zst(opt, incr, src));
+	CHECK(!has_member(incr, "src/a.txt"));
+	CHECK(!has_member(incr, "src/b.txt"));
+	CHECK(has_member(incr, "src/c.txt"));
+
+	// Without hashes, the touched file counts as changed
+	CHECK(tzst::archive_tar_zst(plain, unhashed, src));
+	CHECK(has_member(unhashed, "src/a.txt"));
+
+	// Restoring the series removes the deleted files
+	const std::string out = tmp.path() / "out";
+	CHECK(tzst::extract_tar_zst(tzst::Option(), full, out));
+	CHECK(exists(out / "src/b.txt"));
+	CHECK(tzst::extract_tar_zst(tzst::Option(), incr, out));
+	CHECK(has_content(out / "src/a.txt", content("a", 5000)));
+	CHECK(!exists(out / "src/b.txt"));
+	CHECK(has_content(out / "src/c.txt", content("c2", 6000)));
+	CHECK(!exists(out / "src/d/e.txt"));
+
+	// Nothing changed since the last run: an empty archive
+	CHECK(tzst::archive_tar_zst(opt, incr, src));
+	CHECK(!has_member(incr, "src/a.txt"));
+	CHECK(!has_member(incr, "src/c.txt"));
+}
+
+/**
+ * @brief Deduplicated archives, extracted as a whole and one duplicate at a time
+ */
+void test_dedup()
+{
+	TempDir tmp;
+	const std::string src = tmp.path() / "src";
+	CHECK(write_file(src / "a" / "one.txt", content("same", 10000)));
+	CHECK(write_file(src / "b" / "two.txt", content("same", 10000)));
+	CHECK(write_file(src / "c" / "big1.bin", content("big", 300000)));
+	CHECK(write_file(src / "c" / "big2.bin", content("big", 300000)));
+	CHECK(write_file(src / "c" / "other.bin", content("bog", 300000)));
+
+	for (bool seekable : { false, true }) {
+		const std::string archive = tmp.path() / (seekable ? "seekable.tzst" : "stream.tzst");
+		tzst::Option opt = seekable ? seekable_option() : tzst::Option();
+		opt.dedup = true;
+		CHECK(tzst::archive_tar_zst(opt, archive, src));
+
+		// Each duplicate is stored once
+		std::vector<tzst::Entry> entries;
+		CHECK(tzst::list_tar_zst(tzst::Option(), archive, &entries));
+		std::vector<std::string> links;
+		for (tzst::Entry const &e : entries) {
+			if (e.typeflag == '1') {
+				links.push_back(e.path);
+			}
+		}
+		CHECK(links.size() == 2);
+
+		// A whole extraction makes hard links
+		const std::string out = tmp.path() / "out";
+		CHECK(tzst::extract_tar_zst(tzst::Option(), archive, out));
+		struct stat st1, st2;
+		CHECK(stat((out / "src/a/one.txt").c_str(), &st1) == 0 && stat((out / "src/b/two.txt").c_str(), &st2) == 0);
+		CHECK(st1.st_ino == st2.st_ino);
+		CHECK(has_content(out / "src/c/big2.bin", content("big", 300000)));
+		CHECK(has_content(out / "src/c/other.bin", content("bog", 300000)));
+		remove_tree(out);
+
+		// Only the duplicates, without the files they were stored as
+		CHECK(tzst::extract_tar_zst(tzst::Option(), archive, out, links));
+		for (std::string const &link : links) {
+			const bool big = link.compare(0, 6, "src/c/") == 0;
+			CHECK(has_content(out / link, big ? content("big", 300000) : content("same", 10000)));
+		}
+		CHECK(exists(out / "src/a/one.txt") != exists(out / "src/b/two.txt"));
+		CHECK(exists(out / "src/c/big1.bin") != exists(out / "src/c/big2.bin"));
+		CHECK(!exists(out / "src/c/other.bin"));
+		remove_tree(out);
+
+		// A single duplicate through the table of contents
+		if (seekable) {
+			CHECK(tzst::extract_member(tzst::Option(), archive, links[0], out));
+			CHECK(exists(out / links[0]));
+			CHECK(!exists(out / "src/c/other.bin"));
+			remove_tree(out);
+		}
+	}
+}
+
+/**
+ * @brief Sparse files keep their content and their holes
+ */
+void test_sparse()
+{
+	TempDir tmp;
+	const std::string src = tmp.path() / "src";
+	const std::string path = src / "holes.img";
+	const uint64_t size = 8 << 20;
+	std::string expected(size, 0);
+	CHECK(misc::mkdirs(src));
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0 && ftruncate(fd, (off_t)size) == 0);
+	// Data at the start, in the middle and at the very end
+	for (uint64_t offset : { (uint64_t)0, (uint64_t)3 << 20, size - 100000 }) {
+		std::string data = content("data" + std::to_string(offset), 100000);
+		CHECK(pwrite(fd, data.data(), data.size(), (off_t)offset) == (ssize_t)data.size());
+		expected.replace(offset, data.size(), data);
+	}
+	close(fd);
+	CHECK(write_file(src / "plain.txt", content("plain", 1000)));
+	struct stat st;
+	CHECK(stat(path.c_str(), &st) == 0);
+	if ((uint64_t)st.st_blocks * 512 >= size) {
+		fprintf(stderr, "note: %s does not support holes, only the content is checked\n", tmp.path().c_str());
+	}
+
+	for (bool seekable : { false, true }) {
+		const std::string archive = tmp.path() / (seekable ? "seekable.tzst" : "stream.tzst");
+		CHECK(tzst::archive_tar_zst(seekable ? seekable_option() : tzst::Option(), archive, src));
+		struct stat ast;
+		CHECK(stat(archive.c_str(), &ast) == 0 && (uint64_t)ast.st_size < size / 8);
+
+		const std::string out = tmp.path() / "out";
+		CHECK(tzst::extract_tar_zst(tzst::Option(), archive, out));
+		CHECK(has_content(out / "src/holes.img", expected));
+		CHECK(has_content(out / "src/plain.txt", content("plain", 1000)));
+		struct stat xst;
+		CHECK(stat((out / "src/holes.img").c_str(), &xst) == 0);
+		CHECK(xst.st_blocks <= st.st_blocks);
+		remove_tree(out);
+	}
+}
+
+/**
+ * @brief Append a ustar member to a tar stream
+ */
+void tar_append(std::string *tar, std::string const &name, char typeflag, std::string const &data)
+{
+	char h[512] = {};
+	memcpy(h, name.data(), std::min(name.size(), (size_t)100));
+	snprintf(h + 100, 8, "%07o", 0644);
+	snprintf(h + 108, 8, "%07o", 0);
+	snprintf(h + 116, 8, "%07o", 0);
+	snprintf(h + 124, 12, "%011o", (unsigned)data.size());
+	snprintf(h + 136, 12, "%011o", 0);
+	h[156] = typeflag;
+	memcpy(h + 257, "ustar\0" "00", 8);
+	memset(h + 148, ' ', 8);
+	unsigned sum = 0;
+	for (unsigned char c : h) {
+		sum += c;
+	}
+	snprintf(h + 148, 8, "%06o", sum);
+	tar->append(h, sizeof(h));
+	tar->append(data);
+	tar->append((512 - data.size() % 512) % 512, '\0');
+}
+
+/**
+ * @brief Members with absolute paths or ".." components are not extracted
+ */
+void test_unsafe_paths()
+{
+	TempDir tmp;
+	const std::string out = tmp.path() / "out";
+	std::string tar;
+	tar_append(&tar, "../escaped.txt", '0', "outside");
+	tar_append(&tar, tmp.path() / "absolute.txt", '0', "outside");
+	tar_append(&tar, "d/../../up/", '5', {});
+	tar_append(&tar, "safe.txt", '0', "inside");
+	tar.append(1024, '\0');
+	std::string archive;
+	size_t pos = 0;
+	ZS zs;
+	CHECK(zs.compress(ZS::Option(), [&](char *ptr, int len){
+		int n = (int)std::min(tar.size() - pos, (size_t)len);
+		memcpy(ptr, tar.data() + pos, n);
+		pos += n;
+		return n;
+	}, [&](char const *ptr, int len){
+		archive.append(ptr, len);
+		return len;
+	}));
+	CHECK(misc::mkdirs(out));
+	CHECK(!tzst::extract_tar_zst(tzst::Option(), archive.data(), archive.size(), out));
+	CHECK(has_content(out / "safe.txt", "inside"));
+	CHECK(!exists(tmp.path() / "escaped.txt"));
+	CHECK(!exists(tmp.path() / "absolute.txt"));
+	CHECK(!exists(tmp.path() / "up"));
+}
+
+/**
+ * @brief Symbolic links to directories are followed, but not into a loop
+ */
+void test_symlink_loop()
+{
+	TempDir tmp;
+	const std::string src = tmp.path() / "src";
+	CHECK(write_file(src / "a" / "b" / "f.txt", "f"));
+	CHECK(symlink("..", (src / "a" / "self").c_str()) == 0);
+	CHECK(symlink("../..", (src / "a" / "b" / "up").c_str()) == 0);
+	CHECK(symlink("b", (src / "a" / "link").c_str()) == 0);
+	std::vector<misc::FileItem> files;
+	misc::scan_files(src, {}, &files);
+	std::vector<std::string> paths;
+	for (misc::FileItem const &item : files) {
+		paths.push_back(item.target_path);
+	}
+	CHECK((paths == std::vector<std::string>{ "a/b/f.txt", "a/link/f.txt" }));
+}
+
+struct Test {
+	char const *name;
+	void (*fn)();
+};
+
+const Test TESTS[] = {
+	{ "toc_extraction", test_toc_extraction },
+	{ "snapshot", test_snapshot },
+	{ "dedup", test_dedup },
+	{ "sparse", test_sparse },
+	{ "unsafe_paths", test_unsafe_paths },
+	{ "symlink_loop", test_symlink_loop },
+};
+
+}
+
+int main(int argc, char **argv)
+{
+	for (Test const &t : TESTS) {
+		if (argc > 1 && strcmp(argv[1], t.name) != 0) continue;
+		const int before = failures;
+		t.fn();
+		printf("%s: %s\n", failures == before ? "ok" : "FAILED", t.name);
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -1,11 +1,23 @@
 #include "tzst.h"
+#include "joinpath.h"
+#include "misc.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "tar.h"
 #include "zs.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
 #include <deque>
 #include <fcntl.h>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <sys/stat.h>
+#include <thread>
 #include <vector>
 
 #ifdef _WIN32
@@ -15,8 +27,463 @@
 #define O_BINARY (0)
 #endif
 
+// Table of contents: a skippable frame listed last in the seek table.
+// Content (little endian): magic, number of entries, then for each entry
+// offset, length, size (u64), mode, frame (u32), typeflag (u8),
+// path length (u32) and path.
+static const uint32_t TOC_SKIPPABLE_MAGIC = 0x184D2A5D;
+static const uint32_t TOC_MAGIC = 0x43545A54;
+
+// Dictionary: a skippable frame at the very start of the archive holding
+// a zstd dictionary that all compressed frames depend on.
+static const uint32_t DICT_SKIPPABLE_MAGIC = 0x184D2A5C;
+
+// Deletions: a skippable frame at the start of an incremental archive,
+// after the dictionary if any, listing the paths removed since the
+// snapshot. Content (little endian): magic, number of paths, then for each
+// path its length (u32) and the path.
+static const uint32_t DELETED_SKIPPABLE_MAGIC = 0x184D2A5B;
+static const uint32_t DELETED_MAGIC = 0x4C445A54;
+
+/**
+ * @brief Append a little endian value
+ * @param out Output buffer
+ * @param v Value
+ * @param bytes Number of bytes
+ */
+static void put_le(std::vector<char> *out, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		out->push_back((char)(v >> (8 * i)));
+	}
+}
+
+/**
+ * @brief Load a little endian value
+ * @param p Pointer to the value
+ * @param bytes Number of bytes
+ * @return Value
+ */
+static uint64_t get_le(char const *p, int bytes)
+{
+	uint64_t v = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		v = (v << 8) | (unsigned char)p[i];
+	}
+	return v;
+}
+
+/**
+ * @brief Start a table of contents
+ * @param toc Output buffer
+ */
+static void toc_begin(std::vector<char> *toc)
+{
+	toc->clear();
+	put_le(toc, TOC_MAGIC, 4);
+	put_le(toc, 0, 4); // number of entries, filled in by toc_end()
+}
+
+/**
+ * @brief Append an entry to a table of contents
+ * @param toc Output buffer
+ * @param e Entry
+ */
+static void toc_append(std::vector<char> *toc, tzst::Entry const &e)
+{
+	put_le(toc, e.offset, 8);
+	put_le(toc, e.length, 8);
+	put_le(toc, e.size, 8);
+	put_le(toc, (uint32_t)e.mode, 4);
+	put_le(toc, e.frame, 4);
+	toc->push_back(e.typeflag);
+	put_le(toc, e.path.size(), 4);
+	toc->insert(toc->end(), e.path.begin(), e.path.end());
+}
+
+/**
+ * @brief Finish a table of contents
+ * @param toc Output buffer
+ * @param count Number of entries
+ */
+static void toc_end(std::vector<char> *toc, uint32_t count)
+{
+	for (int i = 0; i < 4; i++) {
+		(*toc)[4 + i] = (char)(count >> (8 * i));
+	}
+}
+
+/**
+ * @brief Parse a table of contents
+ * @param p Pointer to the content of the skippable frame
+ * @param len Length of the content
+ * @param out Output vector for the entries
+ * @return true if successful, false otherwise
+ */
+static bool toc_parse(char const *p, size_t len, std::vector<tzst::Entry> *out)
+{
+	out->clear();
+	if (len < 8 || get_le(p, 4) != TOC_MAGIC) return false;
+	const uint32_t count = (uint32_t)get_le(p + 4, 4);
+	char const *end = p + len;
+	p += 8;
+	for (uint32_t i = 0; i < count; i++) {
+		if (end - p < 37) return false;
+		tzst::Entry e;
+		e.offset = get_le(p, 8);
+		e.length = get_le(p + 8, 8);
+		e.size = get_le(p + 16, 8);
+		e.mode = (int)get_le(p + 24, 4);
+		e.frame = (uint32_t)get_le(p + 28, 4);
+		e.typeflag = p[32];
+		const uint32_t n = (uint32_t)get_le(p + 33, 4);
+		p += 37;
+		if ((size_t)(end - p) < n) return false;
+		e.path.assign(p, n);
+		p += n;
+		out->push_back(std::move(e));
+	}
+	return true;
+}
+
+/**
+ * @brief Build the list of deleted paths
+ * @param paths Paths removed since the snapshot
+ * @param out Output buffer
+ */
+static void deleted_build(std::vector<std::string> const &paths, std::vector<char> *out)
+{
+	out->clear();
+	put_le(out, DELETED_MAGIC, 4);
+	put_le(out, paths.size(), 4);
+	for (std::string const &path : paths) {
+		put_le(out, path.size(), 4);
+		out->insert(out->end(), path.begin(), path.end());
+	}
+}
+
+/**
+ * @brief Parse a list of deleted paths
+ * @param p Pointer to the content of the skippable frame
+ * @param len Length of the content
+ * @param out Output vector for the paths
+ * @return true if successful, false otherwise
+ */
+static bool deleted_parse(char const *p, size_t len, std::vector<std::string> *out)
+{
+	out->clear();
+	if (len < 8 || get_le(p, 4) != DELETED_MAGIC) return false;
+	const uint32_t count = (uint32_t)get_le(p + 4, 4);
+	char const *end = p + len;
+	p += 8;
+	for (uint32_t i = 0; i < count; i++) {
+		if (end - p < 4) return false;
+		const uint32_t n = (uint32_t)get_le(p, 4);
+		p += 4;
+		if ((size_t)(end - p) < n) return false;
+		out->emplace_back(p, n);
+		p += n;
+	}
+	return true;
+}
+
+namespace {
+
+/**
+ * @brief Rate limiter turning progress updates into calls of the progress callback
+ */
+class ProgressMeter {
+private:
+	using clock = std::chrono::steady_clock;
+	std::function<void (tzst::Progress const &)> fn_;
+	clock::duration interval_;
+	clock::time_point start_;
+	clock::time_point last_;
+	uint64_t last_bytes_ = 0;
+	tzst::Progress progress_;
+	/**
+	 * @brief Call the progress callback with the current state
+	 */
+	void report(clock::time_point now)
+	{
+		const double dt = std::chrono::duration<double>(now - last_).count();
+		progress_.bytes_per_sec = dt > 0 ? (progress_.bytes - last_bytes_) / dt : 0;
+		progress_.elapsed = std::chrono::duration<double>(now - start_).count();
+		last_ = now;
+		last_bytes_ = progress_.bytes;
+		fn_(progress_);
+	}
+public:
+	/**
+	 * @brief Constructor for ProgressMeter
+	 * @param opt Options with the progress callback (nothing is reported without one)
+	 * @param total Totals if known in advance
+	 */
+	ProgressMeter(tzst::Option const &opt, tar::Progress const &total = {})
+		: fn_(opt.progress)
+		, interval_(std::chrono::milliseconds(opt.progress_interval_ms))
+		, start_(clock::now())
+		, last_(start_)
+	{
+		progress_.files_total = total.files_total;
+		progress_.bytes_total = total.bytes_total;
+	}
+	/**
+	 * @brief Check whether a progress callback is set
+	 */
+	bool enabled() const
+	{
+		return (bool)fn_;
+	}
+	/**
+	 * @brief Record progress; the callback is called if the interval has passed
+	 * @param p Progress so far
+	 */
+	void update(tar::Progress const &p)
+	{
+		progress_.files = p.files;
+		progress_.bytes = p.bytes;
+		if (p.files_total) progress_.files_total = p.files_total;
+		if (p.bytes_total) progress_.bytes_total = p.bytes_total;
+		const clock::time_point now = clock::now();
+		if (now - last_ >= interval_) {
+			report(now);
+		}
+	}
+	/**
+	 * @brief Make the final report
+	 */
+	void finish()
+	{
+		if (!fn_) return;
+		progress_.done = true;
+		report(clock::now());
+	}
+};
+
+/**
+ * @brief Archive output file, optionally written with O_DIRECT
+ *
+ * Direct writes bypass the page cache, so writing a large archive does
+ * not evict the cached data of other programs. They must be aligned: data
+ * is collected in an aligned buffer and written in whole buffers, and the
+ * last partial block is written once O_DIRECT has been turned off again.
+ */
+class OutputFile {
+private:
+	static constexpr size_t DIRECT_ALIGN = 4096;
+	static constexpr size_t DIRECT_BUF_SIZE = 4 << 20;
+	int fd_ = -1;
+	bool direct_ = false;
+	std::vector<char> mem_;
+	char *buf_ = nullptr; // DIRECT_ALIGN aligned start of mem_
+	size_t len_ = 0;
+	/**
+	 * @brief Write the whole blocks of the buffer directly
+	 * @return true if successful, false otherwise
+	 */
+	bool flush_blocks()
+	{
+		const size_t n = len_ / DIRECT_ALIGN * DIRECT_ALIGN;
+		if (n == 0) return true;
+		if (!misc::write_fully(fd_, buf_, n)) return false;
+		memmove(buf_, buf_ + n, len_ - n);
+		len_ -= n;
+		return true;
+	}
+public:
+	~OutputFile()
+	{
+		close();
+	}
+	/**
+	 * @brief Create the file
+	 *
+	 * Where O_DIRECT is not supported (by the platform, or by the file system
+	 * when open() fails with EINVAL), the file is written through the page
+	 * cache and a warning is printed. Other errors fail, with errno set.
+	 * @param path File path
+	 * @param direct true to write with O_DIRECT
+	 * @return true if successful, false otherwise
+	 */
+	bool open(std::string const &path, bool direct)
+	{
+#ifdef O_DIRECT
+		if (direct) {
+			fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY | O_DIRECT, 0644);
+			if (fd_ != -1) {
+				direct_ = true;
+				mem_.resize(DIRECT_BUF_SIZE + DIRECT_ALIGN);
+				buf_ = mem_.data() + (DIRECT_ALIGN - (uintptr_t)mem_.data() % DIRECT_ALIGN) % DIRECT_ALIGN;
+				return true;
+			}
+			if (errno != EINVAL) return false;
+		}
+#endif
+		if (direct) {
+			fprintf(stderr, "warning: direct I/O is not supported, writing through the page cache: %s\n", path.c_str());
+		}
+		fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+		return fd_ != -1;
+	}
+	/**
+	 * @brief Write data
+	 * @param ptr Pointer to data
+	 * @param len Length of data
+	 * @return true if successful, false otherwise
+	 */
+	bool write(char const *ptr, size_t len)
+	{
+		if (!direct_) return misc::write_fully(fd_, ptr, len);
+		while (len > 0) {
+			const size_t n = std::min(len, DIRECT_BUF_SIZE - len_);
+			memcpy(buf_ + len_, ptr, n);
+			len_ += n;
+			ptr += n;
+			len -= n;
+			if (len_ == DIRECT_BUF_SIZE && !flush_blocks()) return false;
+		}
+		return true;
+	}
+	/**
+	 * @brief Write what is buffered and close the file
+	 * @return true if successful, false otherwise
+	 */
+	bool close()
+	{
+		if (fd_ == -1) return true;
+		bool ok = true;
+#ifdef O_DIRECT
+		if (direct_) {
+			ok = flush_blocks();
+			if (len_ > 0) {
+				ok = ok && fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT) == 0;
+				ok = ok && misc::write_fully(fd_, buf_, len_);
+			}
+			direct_ = false;
+			len_ = 0;
+		}
+#endif
+		ok = ::close(fd_) == 0 && ok;
+		fd_ = -1;
+		return ok;
+	}
+};
+
+} // namespace
+
+/**
+ * @brief Train a dictionary on a sample of the files to be archived
+ *
+ * Samples of at most 128 KB are taken from files spread evenly over the
+ * list, about 100 times the dictionary size in total.
+ * @param opt Compression options
+ * @param files Files to archive, as returned by misc::scan_files()
+ * @return Dictionary, or nullptr if training failed
+ */
+static std::shared_ptr<ZS::Dictionary const> train_dictionary(tzst::Option const &opt, std::vector<misc::FileItem> const &files)
+{
+	const size_t max_sample = 128 << 10;
+	const uint64_t budget = (uint64_t)opt.dict_size * 100;
+
+	uint64_t total = 0;
+	for (misc::FileItem const &item : files) {
+		total += std::min(item.size, (uint64_t)max_sample);
+	}
+	const size_t stride = (size_t)std::max((uint64_t)1, (total + budget - 1) / budget);
+
+	std::vector<char> samples;
+	std::vector<size_t> sizes;
+	for (size_t i = 0; i < files.size() && samples.size() < budget; i += stride) {
+		const size_t len = (size_t)std::min(files[i].size, (uint64_t)max_sample);
+		if (len == 0) continue;
+		int fd = open(files[i].source_path.c_str(), O_RDONLY | O_BINARY);
+		if (fd == -1) continue;
+		const size_t pos = samples.size();
+		samples.resize(pos + len);
+		if (misc::pread_fully(fd, samples.data() + pos, len, 0)) {
+			sizes.push_back(len);
+		} else {
+			samples.resize(pos);
+		}
+		close(fd);
+	}
+
+	ZS zs;
+	std::vector<char> dict;
+	if (!zs.train_dictionary(samples, sizes, opt.dict_size, &dict)) {
+		fprintf(stderr, "warning: dictionary training failed, compressing without dictionary: %s\n", zs.error.c_str());
+		return nullptr;
+	}
+	return std::make_shared<ZS::Dictionary>(std::move(dict), opt.zsopt.clevel);
+}
+
+/**
+ * @brief Keep only the files that changed since a snapshot
+ *
+ * A file is unchanged if its size, mtime and inode number match the
+ * snapshot. If only the mtime or inode number differ and the snapshot
+ * has a hash of the content, the content is hashed to decide. The
+ * snapshot is replaced by the state of the scanned tree.
+ * @param opt Options
+ * @param prefix Directory in the archive that the target paths are relative to
+ * @param files Scanned files, reduced to the new and changed ones
+ * @param snapshot Snapshot of the previous archive, updated to the current state
+ * @param deleted Output paths in the snapshot that no longer exist, sorted
+ */
+static void select_changed(tzst::Option const &opt, std::string const &prefix, std::vector<misc::FileItem> *files, Snapshot *snapshot, std::vector<std::string> *deleted)
+{
+	std::unordered_map<std::string, Snapshot::File> next;
+	next.reserve(files->size());
+	size_t n = 0;
+	for (misc::FileItem &item : *files) {
+		std::string path = prefix.empty() ? item.target_path : (prefix / item.target_path);
+		Snapshot::File f;
+		f.size = item.size;
+		f.mtime = item.mtime;
+		f.ino = item.ino;
+		bool changed = true;
+		auto it = snapshot->files.find(path);
+		if (it != snapshot->files.end()) {
+			Snapshot::File const &old = it->second;
+			if (old.size != f.size) {
+				// changed
+			} else if (old.mtime == f.mtime && old.ino == f.ino) {
+				f = old;
+				changed = false;
+			} else if (old.has_hash && Snapshot::hash_file(item.source_path, &f.hash)) {
+				f.has_hash = true;
+				changed = f.hash != old.hash;
+			}
+			snapshot->files.erase(it);
+		}
+		if (changed && opt.snapshot_hash && !f.has_hash) {
+			f.has_hash = Snapshot::hash_file(item.source_path, &f.hash);
+		}
+		next[std::move(path)] = f;
+		if (changed) {
+			if (&(*files)[n] != &item) {
+				(*files)[n] = std::move(item);
+			}
+			n++;
+		}
+	}
+	files->resize(n);
+
+	deleted->clear();
+	for (auto const &pair : snapshot->files) {
+		deleted->push_back(pair.first);
+	}
+	std::sort(deleted->begin(), deleted->end());
+	snapshot->files = std::move(next);
+}
+
 /**
  * @brief Create a tar.zst archive from a directory
+ *
+ * With a snapshot manifest, only the files that are new or changed since
+ * the manifest was written are archived, the paths that disappeared are
+ * recorded in the archive, and the manifest is updated on success.
  * @param opt Compression options
  * @param archive_path Output archive file path
  * @param src_dir Source directory to archive
@@ -25,94 +492,824 @@
  */
 bool tzst::archive_tar_zst(Option const &opt, std::string const &archive_path, std::string const &src_dir, std::string const &dst_prefix_dir)
 {
+	// Incremental archives hold the files changed since the snapshot
+	Snapshot snapshot;
+	if (!opt.snapshot.empty() && !snapshot.load(opt.snapshot)) return false;
+
+	// The tree is scanned once, for the snapshot, the dictionary and the archive
+	std::vector<misc::FileItem> files;
+	std::vector<std::string> deleted;
+	const std::string prefix = tar::TarWriter::archive_prefix(src_dir, dst_prefix_dir);
+	{
+		Stats::Scope s(opt.stats, Stats::Scan);
+		misc::scan_files(src_dir.empty() ? "." : src_dir, "", &files);
+	}
+	if (!opt.snapshot.empty()) {
+		select_changed(opt, prefix, &files, &snapshot, &deleted);
+	}
+
 	// Open output file for writing
-	int fd_tarzst_out = open(archive_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
-	if (fd_tarzst_out == -1) {
-		fprintf(stderr, "Could not create file: %s", archive_path.c_str());
+	OutputFile out;
+	if (!out.open(archive_path, opt.direct_output)) {
+		fprintf(stderr, "Could not create file: %s: %s\n", archive_path.c_str(), strerror(errno));
 		return false;
 	}
 
-	// Create tar archive in memory buffer
-	std::deque<char> tar_buffer;
+	ZS::Option zsopt = opt.zsopt;
+	if (!zsopt.dict && opt.dict_size > 0) {
+		Stats::Scope s(opt.stats, Stats::Compress);
+		zsopt.dict = train_dictionary(opt, files);
+	}
+
+	// Compressed data goes straight to the output file
+	ZS::Compressor zs(zsopt, [&](char const *ptr, int len)->int{
+		Stats::Scope s(opt.stats, Stats::Write);
+		s.bytes(len, len);
+		if (opt.stats) opt.stats->add(Stats::Compress, 0, len);
+		return out.write(ptr, len) ? len : -1;
+	});
+	// The dictionary comes first so that readers can load it before any frame
+	if (zsopt.dict) {
+		std::vector<char> const &dict = zsopt.dict->data();
+		zs.write_skippable(DICT_SKIPPABLE_MAGIC, dict.data(), dict.size());
+	}
+	if (!deleted.empty()) {
+		std::vector<char> list;
+		deleted_build(deleted, &list);
+		zs.write_skippable(DELETED_SKIPPABLE_MAGIC, list.data(), list.size());
+	}
+
+	// Tar stream is fed to the compressor as it is produced
+	uint64_t tar_offset = 0;
 	tar::TarWriter tar([&](char const *ptr, int len)->int{
-		tar_buffer.insert(tar_buffer.end(), ptr, ptr + len);
-		return len;
+		tar_offset += len;
+		Stats::Scope s(opt.stats, Stats::Compress);
+		s.bytes(len);
+		bool ok = zs.write(ptr, len);
+		if (opt.stats) {
+			opt.stats->buffered(Stats::TarBuffers, tar.buffered());
+			opt.stats->buffered(Stats::CompressBuffers, zs.buffered());
+		}
+		return ok ? len : -1;
 	});
-	tar.archive(src_dir, dst_prefix_dir);
-
-	{
-		// Input callback: read from tar buffer
-		auto In = [&](char *ptr, int len)->int{
-			int total = 0;
-			while (len > 0) {
-				if (tar_buffer.empty()) break;
-				int n = std::min((int)tar_buffer.size(), len);
-				std::copy(tar_buffer.begin(), tar_buffer.begin() + n, ptr);
-				tar_buffer.erase(tar_buffer.begin(), tar_buffer.begin() + n);
-				ptr += n;
-				len -= n;
-				total += n;
+	tar.set_stats(opt.stats);
+	tar.set_verbose(opt.verbose);
+	tar.set_dedup(opt.dedup);
+	tar.set_io_backend(opt.io_backend);
+	tar.set_cache_hints(opt.drop_cache, opt.readahead);
+	ProgressMeter meter(opt);
+	if (meter.enabled()) {
+		tar.set_progress_callback([&](tar::Progress const &p){
+			meter.update(p);
+		});
+	}
+	// Incompressible content is stored instead of compressed
+	if (opt.store_incompressible) {
+		tar.set_store_callback([&](bool store){
+			Stats::Scope s(opt.stats, Stats::Compress);
+			zs.set_store(store);
+		});
+	}
+	// Seekable archives get a table of contents
+	std::vector<char> toc;
+	uint32_t toc_entries = 0;
+	tzst::Entry e; // reused, so that entries are appended without allocations
+	if (zsopt.frame_size > 0) {
+		toc_begin(&toc);
+		tar.set_entry_callback([&](tar::TarData const &data, uint64_t size){
+			// Start seekable frames at entry boundaries where possible
+			if (!zs.mark_entry(size)) return false;
+			e.path.assign(data.filename);
+			e.size = data.length;
+			e.mode = data.mode;
+			e.typeflag = data.typeflag;
+			e.offset = tar_offset;
+			e.length = size;
+			e.frame = (uint32_t)zs.frame_index();
+			toc_append(&toc, e);
+			toc_entries++;
+			return true;
+		});
+	}
+	bool ok = tar.archive(files, prefix);
+
+	Stats::Scope s(opt.stats, Stats::Compress);
+	if (!toc.empty()) {
+		toc_end(&toc, toc_entries);
+		zs.write_skippable(TOC_SKIPPABLE_MAGIC, toc.data(), toc.size());
+	}
+	if (!zs.finish()) {
+		fprintf(stderr, "error: %s\n", zs.error().c_str());
+		ok = false;
+	}
+
+	{
+		Stats::Scope s(opt.stats, Stats::Write);
+		if (!out.close()) {
+			fprintf(stderr, "error: failed to write the archive: %s\n", archive_path.c_str());
+			ok = false;
+		}
+	}
+	meter.finish();
+	// The next archive of the series is made against the state just archived;
+	// after a failure the manifest is kept, so that missed files are archived next time
+	if (ok && !opt.snapshot.empty()) {
+		ok = snapshot.save(opt.snapshot);
+	}
+	return ok;
+}
+
+namespace {
+
+/**
+ * @brief Bounded queue of data chunks passed between two threads
+ *
+ * push() blocks while the queue is full, which throttles the producer to
+ * the speed of the consumer and keeps memory usage bounded.
+ */
+class ChunkQueue {
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<std::vector<char>> queue_;
+	size_t max_bytes_;
+	size_t bytes_ = 0;
+	bool closed_ = false;
+	Stats *stats_;
+public:
+	explicit ChunkQueue(size_t max_bytes, Stats *stats = nullptr)
+		: max_bytes_(max_bytes)
+		, stats_(stats)
+	{
+	}
+	/**
+	 * @brief Append a chunk, waiting for free space if necessary
+	 *
+	 * A chunk larger than the limit is accepted once the queue is empty.
+	 * @param chunk Data chunk
+	 * @return false if the queue has been closed
+	 */
+	bool push(std::vector<char> &&chunk)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [&](){ return closed_ || bytes_ == 0 || bytes_ + chunk.size() <= max_bytes_; });
+		if (closed_) return false;
+		bytes_ += chunk.size();
+		if (stats_) stats_->buffered(Stats::DecompressQueue, bytes_);
+		queue_.push_back(std::move(chunk));
+		cond_.notify_all();
+		return true;
+	}
+	/**
+	 * @brief Take the next chunk, waiting until one is available
+	 * @param chunk Output chunk
+	 * @return false if the queue is closed and empty
+	 */
+	bool pop(std::vector<char> *chunk)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [&](){ return closed_ || !queue_.empty(); });
+		if (queue_.empty()) return false;
+		*chunk = std::move(queue_.front());
+		queue_.pop_front();
+		bytes_ -= chunk->size();
+		if (stats_) stats_->buffered(Stats::DecompressQueue, bytes_);
+		cond_.notify_all();
+		return true;
+	}
+	/**
+	 * @brief Close the queue and wake up all waiting threads
+	 */
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		cond_.notify_all();
+	}
+};
+
+/**
+ * @brief Reader side of a ChunkQueue with a local cursor
+ */
+class ChunkReader {
+private:
+	ChunkQueue *queue_;
+	std::vector<char> chunk_;
+	size_t pos_ = 0;
+public:
+	explicit ChunkReader(ChunkQueue *queue)
+		: queue_(queue)
+	{
+	}
+	/**
+	 * @brief Read exactly len bytes unless the end of stream is reached
+	 * @param ptr Output buffer
+	 * @param len Number of bytes to read
+	 * @return Number of bytes read
+	 */
+	int read(char *ptr, int len)
+	{
+		int total = 0;
+		while (total < len) {
+			if (pos_ == chunk_.size()) {
+				pos_ = 0;
+				chunk_.clear();
+				if (!queue_->pop(&chunk_)) break;
+				continue;
+			}
+			int n = (int)std::min((size_t)(len - total), chunk_.size() - pos_);
+			memcpy(ptr + total, chunk_.data() + pos_, n);
+			pos_ += n;
+			total += n;
+		}
+		return total;
+	}
+	/**
+	 * @brief Skip len bytes by advancing the cursor, without copying
+	 * @param len Number of bytes to skip
+	 * @return false if the end of stream was reached first
+	 */
+	bool skip(uint64_t len)
+	{
+		while (len > 0) {
+			if (pos_ == chunk_.size()) {
+				pos_ = 0;
+				chunk_.clear();
+				if (!queue_->pop(&chunk_)) return false;
+				continue;
+			}
+			size_t n = (size_t)std::min((uint64_t)(chunk_.size() - pos_), len);
+			pos_ += n;
+			len -= n;
+		}
+		return true;
+	}
+	/**
+	 * @brief Discard everything left in the stream
+	 */
+	void drain()
+	{
+		while (queue_->pop(&chunk_));
+		chunk_.clear();
+		pos_ = 0;
+	}
+};
+
+/**
+ * @brief Read a tar stream while it is being decompressed
+ *
+ * Decompression runs on a separate thread and hands its output to the tar
+ * parser through a bounded queue, so only a few decompression buffers are
+ * in memory at any time and files are written while the archive is still
+ * being decompressed. Skipped content is stepped over in the queued
+ * buffers without being copied. If the consumer stops before the end of
+ * the archive, decompression is abandoned.
+ * @param decompress_fn Decompression function, called on the producer thread with a function that accepts decompressed chunks
+ * @param consume_fn Function consuming the tar stream, e.g. extracting or listing it
+ * @param stats Statistics to record the stages into (nullptr: none)
+ * @return true if successful, false otherwise
+ */
+bool read_with(std::function<bool (std::function<bool (std::vector<char> &&)> const &out_fn, std::string *error)> const &decompress_fn, std::function<bool (tar::TarReader *)> const &consume_fn, Stats *stats)
+{
+	ChunkQueue queue(2 << 20, stats);
+
+	// Producer: decompress into the queue
+	bool decompressed = false;
+	bool abandoned = false; // the consumer stopped taking output
+	std::string error;
+	std::thread th([&](){
+		Stats::Scope s(stats, Stats::Decompress);
+		decompressed = decompress_fn([&](std::vector<char> &&chunk){
+			s.bytes(0, chunk.size());
+			if (!queue.push(std::move(chunk))) {
+				abandoned = true;
+				return false;
 			}
-			return total;
-		};
-		// Output callback: write compressed data to file
-		auto Out = [&](char const *ptr, int len)->int{
-			write(fd_tarzst_out, ptr, len);
-			return len;
-		};
-		// Compress tar data with zstd
+			return true;
+		}, &error);
+		queue.close();
+	});
+
+	// Consumer: parse the tar stream
+	ChunkReader reader(&queue);
+	tar::TarReader tar_reader([&](char *ptr, int len)->int{
+		int n = reader.read(ptr, len);
+		if (stats && n > 0) stats->add(Stats::Tar, n);
+		return n;
+	});
+	tar_reader.set_skipper([&](uint64_t len){
+		return reader.skip(len);
+	});
+	tar_reader.set_stats(stats);
+	bool ok;
+	{
+		Stats::Scope s(stats, Stats::Tar);
+		ok = consume_fn(&tar_reader);
+	}
+	const bool complete = ok && tar_reader.at_end();
+	if (complete) {
+		// Consume the trailing padding so that the frame checksum is verified
+		reader.drain();
+	} else {
+		// Failed, or stopped early: abandon the rest of the stream
+		queue.close();
+	}
+	th.join();
+
+	// A corrupt frame is reported whatever the tar parser made of the stream
+	if (!decompressed && !abandoned) {
+		fprintf(stderr, "error: %s\n", error.c_str());
+		ok = false;
+	}
+	return ok;
+}
+
+/**
+ * @brief Read a tar.zst stream with a single decompression context
+ * @param opt Decompression options
+ * @param in_fn Input callback function to read compressed data
+ * @param consume_fn Function consuming the tar stream
+ * @return true if successful, false otherwise
+ */
+bool read_stream(tzst::Option const &opt, std::function<int (char *, int)> const &in_fn, std::function<bool (tar::TarReader *)> const &consume_fn)
+{
+	return read_with([&](std::function<bool (std::vector<char> &&)> const &out_fn, std::string *error){
+		ZS zs;
+		bool ok = zs.decompress(opt.zsopt, in_fn, [&](char const *ptr, int len){
+			return out_fn(std::vector<char>(ptr, ptr + len)) ? len : -1;
+		});
+		*error = zs.error;
+		return ok;
+	}, consume_fn, opt.stats);
+}
+
+/**
+ * @brief Options for decompressing independent frames
+ *
+ * Frames are decompressed on all cores unless a number of workers is given.
+ * @param opt Decompression options
+ * @return Options with the number of workers to use
+ */
+ZS::Option frames_option(ZS::Option const &opt)
+{
+	ZS::Option o = opt;
+	if (o.nbworkers == 0) {
+		o.nbworkers = -1;
+	}
+	return o;
+}
+
+/**
+ * @brief Read a multi-frame tar.zst archive, decompressing frames in parallel
+ * @param opt Decompression options
+ * @param frames Frames of the archive
+ * @param read_fn Callback function to read the compressed data of a frame
+ * @param consume_fn Function consuming the tar stream
+ * @return true if successful, false otherwise
+ */
+bool read_frames(tzst::Option const &opt, std::vector<ZS::Frame> const &frames, std::function<bool (ZS::Frame const &, std::vector<char> *)> const &read_fn, std::function<bool (tar::TarReader *)> const &consume_fn)
+{
+	return read_with([&](std::function<bool (std::vector<char> &&)> const &out_fn, std::string *error){
 		ZS zs;
-		zs.compress(opt.zsopt, In, Out);
+		bool ok = zs.decompress_frames(frames_option(opt.zsopt), frames, read_fn, out_fn);
+		*error = zs.error;
+		return ok;
+	}, consume_fn, opt.stats);
+}
+
+/**
+ * @brief Frames and table of contents of a seekable archive
+ */
+struct Index {
+	std::vector<ZS::Frame> frames;
+	std::vector<tzst::Entry> entries;
+};
+
+/**
+ * @brief Read the seek table and the table of contents of an archive
+ * @param fd File descriptor of the archive
+ * @param out Output index
+ * @return true if the archive has both, false otherwise
+ */
+bool read_index(int fd, Index *out)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) return false;
+	if (!ZS::read_seek_table([&](char *ptr, size_t len, uint64_t offset){
+		return misc::pread_fully(fd, ptr, len, offset);
+	}, st.st_size, &out->frames)) {
+		return false;
 	}
+	if (out->frames.empty()) return false;
+
+	// The table of contents is the last frame
+	ZS::Frame const &f = out->frames.back();
+	if (f.decompressed_size != 0 || f.compressed_size < 8) return false;
+	std::vector<char> buf(f.compressed_size);
+	if (!misc::pread_fully(fd, buf.data(), buf.size(), f.compressed_offset)) return false;
+	if (get_le(buf.data(), 4) != TOC_SKIPPABLE_MAGIC) return false;
+	if (get_le(buf.data() + 4, 4) != buf.size() - 8) return false;
+	return toc_parse(buf.data() + 8, buf.size() - 8, &out->entries);
+}
 
-	close(fd_tarzst_out);
+/**
+ * @brief Check whether frames should be decompressed in parallel
+ */
+bool use_parallel(std::vector<ZS::Frame> const &frames)
+{
+	return frames.size() > 1;
+}
+
+/**
+ * @brief Attach the dictionary embedded at the start of an archive to the options
+ * @param pread_fn Callback function to read len bytes at offset
+ * @param size Size of the archive
+ * @param opt Options to update
+ * @return false if the archive has a broken dictionary frame
+ */
+bool load_dictionary(std::function<bool (char *, size_t, uint64_t)> const &pread_fn, uint64_t size, tzst::Option *opt)
+{
+	char header[8];
+	if (size < sizeof(header) || !pread_fn(header, sizeof(header), 0)) return true;
+	if (get_le(header, 4) != DICT_SKIPPABLE_MAGIC) return true;
+	const uint64_t len = get_le(header + 4, 4);
+	std::vector<char> data;
+	if (len <= size - sizeof(header)) {
+		data.resize(len);
+	}
+	if (data.empty() || !pread_fn(data.data(), data.size(), sizeof(header))) {
+		fprintf(stderr, "error: broken dictionary\n");
+		return false;
+	}
+	opt->zsopt.dict = std::make_shared<ZS::Dictionary>(std::move(data), opt->zsopt.clevel);
 	return true;
 }
 
 /**
- * @brief Extract tar.zst archive from memory buffer
- * @param opt Decompression options
+ * @brief Read the paths deleted since the snapshot an incremental archive was made against
+ * @param pread_fn Callback function to read len bytes at offset
+ * @param size Size of the archive
+ * @param out Output paths (empty if the archive has no deletions)
+ * @return false if the archive has a broken list of deletions
+ */
+bool read_deleted(std::function<bool (char *, size_t, uint64_t)> const &pread_fn, uint64_t size, std::vector<std::string> *out)
+{
+	out->clear();
+	// The list follows the dictionary among the skippable frames at the start
+	uint64_t pos = 0;
+	char header[8];
+	while (size - pos >= sizeof(header) && pread_fn(header, sizeof(header), pos)) {
+		const uint32_t magic = (uint32_t)get_le(header, 4);
+		if ((magic & 0xfffffff0) != 0x184D2A50) break;
+		const uint64_t len = get_le(header + 4, 4);
+		if (len > size - pos - sizeof(header)) break;
+		if (magic == DELETED_SKIPPABLE_MAGIC) {
+			std::vector<char> data(len);
+			if (!pread_fn(data.data(), data.size(), pos + sizeof(header)) || !deleted_parse(data.data(), data.size(), out)) {
+				fprintf(stderr, "error: broken list of deleted files\n");
+				return false;
+			}
+			break;
+		}
+		pos += sizeof(header) + len;
+	}
+	return true;
+}
+
+/**
+ * @brief Remove the files that an incremental archive records as deleted
+ *
+ * Directories left empty by the removal are removed as well. Paths that
+ * are absolute or lead out of the destination directory are ignored.
+ * @param opt Options
+ * @param pread_fn Callback function to read len bytes at offset of the archive
+ * @param size Size of the archive
+ * @param dstdir Destination directory for extraction
+ * @return false if the archive has a broken list of deletions
+ */
+bool apply_deleted(tzst::Option const &opt, std::function<bool (char *, size_t, uint64_t)> const &pread_fn, uint64_t size, std::string const &dstdir)
+{
+	std::vector<std::string> deleted;
+	if (!read_deleted(pread_fn, size, &deleted)) return false;
+	for (std::string const &path : deleted) {
+		if (!tar::is_safe_path(path)) {
+			fprintf(stderr, "warning: ignored unsafe deleted path: %s\n", path.c_str());
+			continue;
+		}
+		std::string target = dstdir.empty() ? path : (dstdir / path);
+		if (remove(target.c_str()) != 0) continue; // already gone
+		if (opt.verbose) {
+			fprintf(stderr, "delete: %s\n", path.c_str());
+		}
+		for (size_t pos = path.find_last_of('/'); pos != std::string::npos && pos > 0; pos = path.find_last_of('/', pos - 1)) {
+			std::string dir = path.substr(0, pos);
+			if (misc::rmdir((dstdir.empty() ? dir : (dstdir / dir)).c_str()) != 0) break;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Read a tar.zst archive from a memory buffer
+ * @param base_opt Decompression options (the embedded dictionary is added)
  * @param tarzst_data Pointer to compressed data
  * @param tarzst_size Size of compressed data
+ * @param consume_fn Function consuming the tar stream
+ * @return true if successful, false otherwise
+ */
+bool read_memory(tzst::Option const &base_opt, char const *tarzst_data, size_t tarzst_size, std::function<bool (tar::TarReader *)> const &consume_fn)
+{
+	tzst::Option opt = base_opt;
+	if (!load_dictionary([&](char *ptr, size_t len, uint64_t offset){
+		if (offset > tarzst_size || len > tarzst_size - offset) return false;
+		memcpy(ptr, tarzst_data + offset, len);
+		return true;
+	}, tarzst_size, &opt)) {
+		return false;
+	}
+
+	std::vector<ZS::Frame> frames;
+	if (ZS::scan_frames(tarzst_data, tarzst_size, &frames) && use_parallel(frames)) {
+		return read_frames(opt, frames, [&](ZS::Frame const &frame, std::vector<char> *out){
+			out->assign(tarzst_data + frame.compressed_offset, tarzst_data + frame.compressed_offset + frame.compressed_size);
+			return true;
+		}, consume_fn);
+	}
+	return read_stream(opt, [&tarzst_data, &tarzst_size](char *ptr, int len){
+		// Input callback: read from compressed buffer
+		len = (int)std::min((size_t)len, tarzst_size);
+		memcpy(ptr, tarzst_data, len);
+		tarzst_data += len;
+		tarzst_size -= len;
+		return len;
+	}, consume_fn);
+}
+
+/**
+ * @brief Read a tar.zst archive from a file
+ *
+ * The archive is read from the file descriptor as decompression proceeds,
+ * it is never loaded into memory as a whole.
+ * @param base_opt Decompression options (the embedded dictionary is added)
+ * @param tarzst_path Path to the tar.zst archive file
+ * @param consume_fn Function consuming the tar stream
+ * @return true if successful, false otherwise
+ */
+bool read_file(tzst::Option const &base_opt, std::string const &tarzst_path, std::function<bool (tar::TarReader *)> const &consume_fn)
+{
+	// Open archive file
+	int fd_in = open(tarzst_path.c_str(), O_RDONLY | O_BINARY);
+	if (fd_in == -1) {
+		fprintf(stderr, "Could not open file: %s\n", tarzst_path.c_str());
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd_in, &st) != 0) {
+		st.st_size = 0;
+	}
+	auto pread_fn = [&](char *ptr, size_t len, uint64_t offset){
+		return misc::pread_fully(fd_in, ptr, len, offset);
+	};
+	tzst::Option opt = base_opt;
+	if (!load_dictionary(pread_fn, st.st_size, &opt)) {
+		close(fd_in);
+		return false;
+	}
+
+	// Decompress frames in parallel if the archive has a seek table
+	std::vector<ZS::Frame> frames;
+	ZS::read_seek_table(pread_fn, st.st_size, &frames);
+
+	bool ok;
+	if (use_parallel(frames)) {
+		ok = read_frames(opt, frames, [&](ZS::Frame const &frame, std::vector<char> *out){
+			Stats::Scope s(opt.stats, Stats::Read);
+			s.bytes(frame.compressed_size);
+			out->resize(frame.compressed_size);
+			return misc::pread_fully(fd_in, out->data(), out->size(), frame.compressed_offset);
+		}, consume_fn);
+	} else {
+		ok = read_stream(opt, [&](char *ptr, int len){
+			// Input callback: read from archive file
+			Stats::Scope s(opt.stats, Stats::Read);
+			int n = (int)::read(fd_in, ptr, len);
+			if (n > 0) s.bytes(n);
+			return n;
+		}, consume_fn);
+	}
+	close(fd_in);
+	return ok;
+}
+
+/**
+ * @brief Collect the entries of a tar stream from its headers
+ * @param reader Tar reader
+ * @param out Output vector for the entries
+ * @return true if successful, false otherwise
+ */
+bool list_entries(tar::TarReader *reader, std::vector<tzst::Entry> *out)
+{
+	return reader->list([&](tar::HeaderInfo const &info){
+		tzst::Entry e;
+		e.path = std::string(info.name);
+		e.size = info.size;
+		e.mode = (int)info.mode;
+		e.typeflag = info.typeflag;
+		out->push_back(std::move(e));
+	});
+}
+
+/**
+ * @brief Sum up the regular files among entries
+ * @param entries Entries
+ * @return Progress totals
+ */
+tar::Progress progress_total(std::vector<tzst::Entry const *> const &entries)
+{
+	tar::Progress total;
+	for (tzst::Entry const *e : entries) {
+		if (e->typeflag == '0' || e->typeflag == 0) {
+			total.files_total++;
+			total.bytes_total += e->size;
+		}
+	}
+	return total;
+}
+
+/**
+ * @brief Extract a tar stream with the verbosity and progress reporting of the options
+ * @param opt Options
+ * @param reader Tar reader
  * @param dstdir Destination directory for extraction
+ * @param filter Filter selecting the members to extract (all if nullptr)
+ * @param total Totals if known in advance
  * @return true if successful, false otherwise
  */
-bool tzst::extract_tar_zst(Option const &opt, char const *tarzst_data, size_t tarzst_size, std::string const &dstdir)
+bool extract_stream(tzst::Option const &opt, tar::TarReader *reader, std::string const &dstdir, tar::MemberFilter *filter = nullptr, tar::Progress const &total = {})
 {
-	// Decompress zstd data
-	std::vector<char> uncompressed;
-	{
-		ZS zs;
-		zs.decompress(opt.zsopt, [&tarzst_data, &tarzst_size](char *ptr, int len){
-			// Input callback: read from compressed buffer
-			len = std::min(len, (int)tarzst_size);
-			memcpy(ptr, tarzst_data, len);
-			tarzst_data += len;
-			tarzst_size -= len;
-			return len;
-		}, [&uncompressed](char const *ptr, int len){
-			// Output callback: store uncompressed data
-			uncompressed.insert(uncompressed.end(), ptr, ptr + len);
-			return len;
+	reader->set_verbose(opt.verbose);
+	reader->set_io_backend(opt.io_backend);
+	ProgressMeter meter(opt, total);
+	if (meter.enabled()) {
+		reader->set_progress_callback([&](tar::Progress const &p){
+			meter.update(p);
 		});
 	}
-	// Extract tar archive from uncompressed data
-	char const *uncomp_data = uncompressed.data();
-	size_t uncomp_size = uncompressed.size();
-	tar::TarReader tar_reader([&](char *ptr, int len)->int{
-		len = std::min(len, (int)uncomp_size);
-		if (len > 0) {
-			memcpy(ptr, uncomp_data, len);
-			uncomp_data += len;
-			uncomp_size -= len;
-			return len;
+	bool ok = reader->extract(dstdir, filter);
+	meter.finish();
+	return ok;
+}
+
+/**
+ * @brief Group the unresolved links of a partial extraction by their targets
+ * @param links Link names and the paths of the members they refer to
+ * @return Link names by member path, for TarReader::set_link_sources()
+ */
+std::map<std::string, std::vector<std::string>> link_sources(std::vector<std::pair<std::string, std::string>> const &links)
+{
+	std::map<std::string, std::vector<std::string>> sources;
+	for (auto const &link : links) {
+		sources[link.second].push_back(link.first);
+	}
+	return sources;
+}
+
+/**
+ * @brief Read the given entries of a seekable archive
+ *
+ * Only the frames holding the entries are read and decompressed, and only
+ * the bytes of the entries are passed to the tar parser.
+ * @param base_opt Decompression options (the embedded dictionary is added)
+ * @param fd File descriptor of the archive
+ * @param index Index of the archive
+ * @param entries Entries to read, in archive order
+ * @param consume_fn Function consuming the tar stream of the entries
+ * @return true if successful, false otherwise
+ */
+bool read_entries(tzst::Option const &base_opt, int fd, Index const &index, std::vector<tzst::Entry const *> const &entries, std::function<bool (tar::TarReader *)> const &consume_fn)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) return false;
+	tzst::Option opt = base_opt;
+	if (!load_dictionary([&](char *ptr, size_t len, uint64_t offset){
+		return misc::pread_fully(fd, ptr, len, offset);
+	}, st.st_size, &opt)) {
+		return false;
+	}
+
+	// Byte ranges of the tar stream to extract, adjacent entries merged
+	std::vector<std::pair<uint64_t, uint64_t>> ranges;
+	std::vector<ZS::Frame> frames;
+	for (tzst::Entry const *e : entries) {
+		if (e->frame >= index.frames.size()) continue;
+		if (!ranges.empty() && ranges.back().second == e->offset) {
+			ranges.back().second += e->length;
 		} else {
-			return 0;
+			ranges.push_back({e->offset, e->offset + e->length});
 		}
+		// Frames covering the entry
+		size_t i = e->frame;
+		while (i < index.frames.size() && !frames.empty() && index.frames[i].decompressed_offset <= frames.back().decompressed_offset) {
+			i++; // already listed for the previous entry
+		}
+		for (; i < index.frames.size() && index.frames[i].decompressed_offset < e->offset + e->length; i++) {
+			frames.push_back(index.frames[i]);
+		}
+	}
+
+	return read_with([&](std::function<bool (std::vector<char> &&)> const &out_fn, std::string *error){
+		// Pass only the bytes of the entries, followed by an end-of-archive marker
+		size_t frame = 0;
+		size_t range = 0;
+		ZS zs;
+		bool decompressed = zs.decompress_frames(frames_option(opt.zsopt), frames, [&](ZS::Frame const &frame, std::vector<char> *out){
+			Stats::Scope s(opt.stats, Stats::Read);
+			s.bytes(frame.compressed_size);
+			out->resize(frame.compressed_size);
+			return misc::pread_fully(fd, out->data(), out->size(), frame.compressed_offset);
+		}, [&](std::vector<char> &&data){
+			const uint64_t begin = frames[frame++].decompressed_offset;
+			const uint64_t end = begin + data.size();
+			while (range < ranges.size() && ranges[range].first < end) {
+				uint64_t from = std::max(ranges[range].first, begin);
+				uint64_t to = std::min(ranges[range].second, end);
+				if (from == begin && to == end) {
+					if (!out_fn(std::move(data))) return false;
+				} else if (from < to) {
+					if (!out_fn(std::vector<char>(data.begin() + (from - begin), data.begin() + (to - begin)))) return false;
+				}
+				if (ranges[range].second > end) break;
+				range++;
+			}
+			return true;
+		});
+		*error = zs.error;
+		return decompressed && out_fn(std::vector<char>(1024, 0));
+	}, consume_fn, opt.stats);
+}
+
+/**
+ * @brief Extract the given entries of a seekable archive
+ *
+ * Hard links to entries that are not given, such as the copies stored
+ * once by --dedup, get the contents of their targets, which are read in
+ * a second pass.
+ * @param opt Decompression options
+ * @param fd File descriptor of the archive
+ * @param index Index of the archive
+ * @param entries Entries to extract, in archive order
+ * @param dstdir Destination directory for extraction
+ * @return true if successful, false otherwise
+ */
+bool extract_entries(tzst::Option const &opt, int fd, Index const &index, std::vector<tzst::Entry const *> const &entries, std::string const &dstdir)
+{
+	std::vector<std::pair<std::string, std::string>> unresolved;
+	if (!read_entries(opt, fd, index, entries, [&](tar::TarReader *reader){
+		reader->set_partial(true);
+		bool ok = extract_stream(opt, reader, dstdir, nullptr, progress_total(entries));
+		unresolved = reader->unresolved_links();
+		return ok;
+	})) {
+		return false;
+	}
+	if (unresolved.empty()) return true;
+
+	const std::map<std::string, std::vector<std::string>> sources = link_sources(unresolved);
+	std::vector<tzst::Entry const *> targets;
+	for (tzst::Entry const &e : index.entries) {
+		if ((e.typeflag == '0' || e.typeflag == 0) && sources.count(e.path)) {
+			targets.push_back(&e);
+		}
+	}
+	return read_entries(opt, fd, index, targets, [&](tar::TarReader *reader){
+		reader->set_link_sources(sources);
+		return extract_stream(opt, reader, dstdir, nullptr, progress_total(targets));
 	});
-	tar_reader.extract(dstdir);
+}
 
-	return true;
+} // namespace
+
+/**
+ * @brief Extract tar.zst archive from memory buffer
+ * @param opt Decompression options
+ * @param tarzst_data Pointer to compressed data
+ * @param tarzst_size Size of compressed data
+ * @param dstdir Destination directory for extraction
+ * @return true if successful, false otherwise
+ */
+bool tzst::extract_tar_zst(Option const &opt, char const *tarzst_data, size_t tarzst_size, std::string const &dstdir)
+{
+	if (!apply_deleted(opt, [&](char *ptr, size_t len, uint64_t offset){
+		if (offset > tarzst_size || len > tarzst_size - offset) return false;
+		memcpy(ptr, tarzst_data + offset, len);
+		return true;
+	}, tarzst_size, dstdir)) {
+		return false;
+	}
+	return read_memory(opt, tarzst_data, tarzst_size, [&](tar::TarReader *reader){
+		return extract_stream(opt, reader, dstdir);
+	});
 }
 
 /**
@@ -124,21 +1321,187 @@ bool tzst::extract_tar_zst(Option const &opt, char const *tarzst_data, size_t ta
  */
 bool tzst::extract_tar_zst(Option const &opt, std::string const &tarzst_path, std::string const &dstdir)
 {
-	// Open archive file
-	int fd_in = open(tarzst_path.c_str(), O_RDONLY | O_BINARY);
-	if (fd_in != -1) {
+	// Files deleted since the previous archive of an incremental series go first
+	int fd = open(tarzst_path.c_str(), O_RDONLY | O_BINARY);
+	if (fd != -1) {
 		struct stat st;
-		if (fstat(fd_in, &st) == 0) {
-			if (st.st_size > 0) {
-				// Read entire file into memory
-				std::vector<char> buf(st.st_size);
-				int n = read(fd_in, buf.data(), st.st_size);
-				if (n == st.st_size) {
-					// Extract from memory buffer
-					return extract_tar_zst(opt, buf.data(), buf.size(), dstdir);
-				}
+		bool ok = fstat(fd, &st) == 0 && apply_deleted(opt, [&](char *ptr, size_t len, uint64_t offset){
+			return misc::pread_fully(fd, ptr, len, offset);
+		}, st.st_size, dstdir);
+		close(fd);
+		if (!ok) return false;
+	}
+	// Totals come from the table of contents, if there is one
+	tar::Progress total;
+	if (opt.progress) {
+		std::vector<Entry> entries;
+		if (read_toc(tarzst_path, &entries)) {
+			std::vector<Entry const *> ptrs;
+			for (Entry const &e : entries) {
+				ptrs.push_back(&e);
 			}
+			total = progress_total(ptrs);
 		}
 	}
-	return false;
+	return read_file(opt, tarzst_path, [&](tar::TarReader *reader){
+		return extract_stream(opt, reader, dstdir, nullptr, total);
+	});
+}
+
+/**
+ * @brief Read the table of contents of a seekable archive
+ * @param tarzst_path Path to the tar.zst archive file
+ * @param out Output vector for the entries
+ * @return true if the archive has a table of contents, false otherwise
+ */
+bool tzst::read_toc(std::string const &tarzst_path, std::vector<Entry> *out)
+{
+	out->clear();
+	int fd = open(tarzst_path.c_str(), O_RDONLY | O_BINARY);
+	if (fd == -1) return false;
+	Index index;
+	bool ok = read_index(fd, &index);
+	close(fd);
+	if (ok) {
+		*out = std::move(index.entries);
+	}
+	return ok;
+}
+
+/**
+ * @brief List the entries of an archive in memory
+ *
+ * Only the headers are parsed; member content is skipped in the
+ * decompressed buffers without being copied.
+ * @param opt Decompression options
+ * @param tarzst_data Pointer to compressed data
+ * @param tarzst_size Size of compressed data
+ * @param out Output vector for the entries
+ * @return true if successful, false otherwise
+ */
+bool tzst::list_tar_zst(Option const &opt, char const *tarzst_data, size_t tarzst_size, std::vector<Entry> *out)
+{
+	out->clear();
+	return read_memory(opt, tarzst_data, tarzst_size, [&](tar::TarReader *reader){
+		return list_entries(reader, out);
+	});
+}
+
+/**
+ * @brief List the entries of an archive
+ *
+ * If the archive has a table of contents, only that is read and nothing
+ * is decompressed. Otherwise the archive is decompressed and only the
+ * headers are parsed, member content is skipped.
+ * @param opt Decompression options
+ * @param tarzst_path Path to the tar.zst archive file
+ * @param out Output vector for the entries
+ * @return true if successful, false otherwise
+ */
+bool tzst::list_tar_zst(Option const &opt, std::string const &tarzst_path, std::vector<Entry> *out)
+{
+	if (read_toc(tarzst_path, out)) return true;
+	return read_file(opt, tarzst_path, [&](tar::TarReader *reader){
+		return list_entries(reader, out);
+	});
+}
+
+/**
+ * @brief Extract selected members of a tar.zst archive
+ *
+ * If the archive has a table of contents, only the frames holding selected
+ * members are decompressed. Otherwise the archive is decompressed as a
+ * stream, unselected members are skipped, and decompression stops once
+ * every named file has been extracted. Selected hard links to members that
+ * were not selected get the contents of those members, read in a second
+ * pass.
+ * @param opt Decompression options
+ * @param tarzst_path Path to the tar.zst archive file
+ * @param dstdir Destination directory for extraction
+ * @param patterns Member paths or wildcard patterns (all members if empty)
+ * @return true if successful, false otherwise
+ */
+bool tzst::extract_tar_zst(Option const &opt, std::string const &tarzst_path, std::string const &dstdir, std::vector<std::string> const &patterns)
+{
+	tar::MemberFilter filter(patterns);
+	if (filter.empty()) {
+		return extract_tar_zst(opt, tarzst_path, dstdir);
+	}
+
+	bool ok;
+	int fd = open(tarzst_path.c_str(), O_RDONLY | O_BINARY);
+	Index index;
+	if (fd != -1 && read_index(fd, &index)) {
+		// Select entries by the table of contents
+		std::vector<Entry const *> entries;
+		for (Entry const &e : index.entries) {
+			if (filter.match(e.path, e.typeflag)) {
+				entries.push_back(&e);
+			}
+		}
+		ok = entries.empty() || extract_entries(opt, fd, index, entries, dstdir);
+		close(fd);
+	} else {
+		if (fd != -1) close(fd);
+		std::vector<std::pair<std::string, std::string>> unresolved;
+		ok = read_file(opt, tarzst_path, [&](tar::TarReader *reader){
+			bool ok = extract_stream(opt, reader, dstdir, &filter);
+			unresolved = reader->unresolved_links();
+			return ok;
+		});
+		// Links to members that were not selected: read the archive again for their contents
+		if (ok && !unresolved.empty()) {
+			const std::map<std::string, std::vector<std::string>> sources = link_sources(unresolved);
+			ok = read_file(opt, tarzst_path, [&](tar::TarReader *reader){
+				reader->set_link_sources(sources);
+				return extract_stream(opt, reader, dstdir);
+			});
+		}
+	}
+
+	for (std::string const &s : filter.missing()) {
+		fprintf(stderr, "error: not found in archive: %s\n", s.c_str());
+		ok = false;
+	}
+	return ok;
+}
+
+/**
+ * @brief Extract a single member of a seekable archive
+ *
+ * The member is looked up in the table of contents, and only the frames
+ * holding it are read and decompressed.
+ * @param opt Decompression options
+ * @param tarzst_path Path to the tar.zst archive file
+ * @param member Path of the member in the archive
+ * @param dstdir Destination directory for extraction
+ * @return true if successful, false otherwise
+ */
+bool tzst::extract_member(Option const &opt, std::string const &tarzst_path, std::string const &member, std::string const &dstdir)
+{
+	int fd = open(tarzst_path.c_str(), O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		fprintf(stderr, "Could not open file: %s\n", tarzst_path.c_str());
+		return false;
+	}
+	Index index;
+	if (!read_index(fd, &index)) {
+		fprintf(stderr, "error: no table of contents: %s\n", tarzst_path.c_str());
+		close(fd);
+		return false;
+	}
+
+	auto it = std::find_if(index.entries.begin(), index.entries.end(), [&](Entry const &e){
+		return e.path == member;
+	});
+	if (it == index.entries.end() || it->frame >= index.frames.size()) {
+		fprintf(stderr, "error: not found in archive: %s\n", member.c_str());
+		close(fd);
+		return false;
+	}
+
+	bool ok = extract_entries(opt, fd, index, {&*it}, dstdir);
+
+	close(fd);
+	return ok;
 }
@@ -1,20 +1,55 @@
 #ifndef TZST_H
 #define TZST_H
 
+#include "iobackend.h"
+#include "tar.h"
 #include "zs.h"
 
 #include <functional>
 #include <string>
+#include <vector>
+
+class Stats;
 
 namespace tzst {
 
+using Progress = tar::Progress;
+
 struct Option {
-	ZS::Option zsopt;
+	ZS::Option zsopt; // when reading, nbworkers 0 decompresses independent frames on all cores
+	size_t dict_size = 0; // >0: train a dictionary of this size and embed it in the archive
+	bool store_incompressible = true; // store compressed formats and high-entropy data uncompressed
+	bool dedup = false; // write files with the content of a file archived before as hard links
+	io::Backend::Type io_backend = io::Backend::Auto; // I/O of small source files and extracted files
+	bool drop_cache = false; // advise the kernel to drop source files from the page cache once archived
+	bool readahead = false; // have the kernel read upcoming source files ahead
+	bool direct_output = false; // write the archive with O_DIRECT, bypassing the page cache
+	Stats *stats = nullptr; // per-stage counters and timers (nullptr: none)
+	bool verbose = false; // print every file to stderr
+	std::function<void (Progress const &progress)> progress; // progress callback (optional)
+	int progress_interval_ms = 500; // minimum time between progress reports
+	std::string snapshot; // manifest for incremental archives: only files changed since it are archived, and it is updated
+	bool snapshot_hash = false; // record content hashes in the manifest, so that files touched without changes are skipped
+};
+
+struct Entry {
+	std::string path;
+	uint64_t size = 0; // content size
+	int mode = 0;
+	char typeflag = '0';
+	uint64_t offset = 0; // offset of the first header in the tar stream
+	uint64_t length = 0; // bytes occupied in the tar stream (headers, content and padding)
+	uint32_t frame = 0; // index of the frame containing the first header
 };
 
 bool archive_tar_zst(Option const &opt, const std::string &archive_path, const std::string &src_dir, const std::string &dst_prefix_dir = {});
 bool extract_tar_zst(Option const &opt, const char *tarzst_data, size_t tarzst_size, const std::string &dstdir = {});
 bool extract_tar_zst(Option const &opt, std::string const &tarzst_path, std::string const &dstdir = {});
+bool extract_tar_zst(Option const &opt, std::string const &tarzst_path, std::string const &dstdir, std::vector<std::string> const &patterns);
+bool read_toc(std::string const &tarzst_path, std::vector<Entry> *out);
+bool list_tar_zst(Option const &opt, const char *tarzst_data, size_t tarzst_size, std::vector<Entry> *out);
+bool list_tar_zst(Option const &opt, std::string const &tarzst_path, std::vector<Entry> *out);
+bool extract_member(Option const &opt, std::string const &tarzst_path, std::string const &member, std::string const &dstdir = {});
 
 }
 
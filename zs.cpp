@@ -1,10 +1,19 @@
 #include "zs.h"
+#include "orderedpool.h"
+#include <algorithm>
 #include <fcntl.h>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <sys/stat.h>
+#include <thread>
+#include <vector>
+#include <zdict.h>
 #include <zstd.h>
 
+#define XXH_STATIC_LINKING_ONLY
+#include <common/xxhash.h>
+
 #ifdef _WIN32
 #include <io.h>
 #define DEFAULT_FILE_PERMISSION (S_IREAD | S_IWRITE)
@@ -43,6 +52,80 @@ public:
 	}
 };
 
+/**
+ * @brief Store a 32-bit little endian value
+ */
+void put_le32(char *p, uint32_t v)
+{
+	p[0] = (char)v;
+	p[1] = (char)(v >> 8);
+	p[2] = (char)(v >> 16);
+	p[3] = (char)(v >> 24);
+}
+
+/**
+ * @brief Load a 32-bit little endian value
+ */
+uint32_t get_le32(char const *p)
+{
+	unsigned char const *q = (unsigned char const *)p;
+	return (uint32_t)q[0] | ((uint32_t)q[1] << 8) | ((uint32_t)q[2] << 16) | ((uint32_t)q[3] << 24);
+}
+
+/**
+ * @brief Get the number of worker threads to use
+ * @param nbworkers Requested number (<0: one per core)
+ */
+int worker_count(int nbworkers)
+{
+	if (nbworkers < 0) {
+		nbworkers = (int)std::thread::hardware_concurrency();
+	}
+	return std::max(nbworkers, 0);
+}
+
+/**
+ * @brief Decompress a single zstd frame into a vector
+ *
+ * The size hint comes from the archive, so it only sizes the initial
+ * buffer up to FRAME_BUFFER_SIZE; the buffer grows with the actual output,
+ * up to ZS::MAX_FRAME_SIZE.
+ * @param dctx Decompression context
+ * @param src Compressed frame
+ * @param srclen Length of compressed frame
+ * @param size_hint Expected decompressed size (0 if unknown)
+ * @param out Output vector
+ * @return Empty string if successful, error message otherwise
+ */
+std::string decompress_frame(ZSTD_DCtx *dctx, char const *src, size_t srclen, size_t size_hint, std::vector<char> *out)
+{
+	static constexpr size_t FRAME_BUFFER_SIZE = 4 << 20;
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	out->resize(size_hint > 0 ? std::min(size_hint, FRAME_BUFFER_SIZE) : ZSTD_DStreamOutSize());
+	ZSTD_inBuffer input = { src, srclen, 0 };
+	ZSTD_outBuffer output = { out->data(), out->size(), 0 };
+	while (1) {
+		const size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+		if (ZSTD_isError(ret)) {
+			return ZSTD_getErrorName(ret);
+		}
+		if (ret == 0) break; // frame completed
+		if (output.pos == output.size) {
+			// Grow the output buffer
+			if (out->size() >= ZS::MAX_FRAME_SIZE) {
+				return "frame too large";
+			}
+			out->resize(std::min(out->size() * 2, (size_t)ZS::MAX_FRAME_SIZE));
+			output.dst = out->data();
+			output.size = out->size();
+		} else if (input.pos == input.size) {
+			return "truncated frame";
+		}
+	}
+	out->resize(output.pos);
+	return {};
+}
+
 } // namespace
 
 /**
@@ -70,6 +153,9 @@ bool ZS::decompress(Option const &opt, std::function<int (char *, int)> in_fn, s
 		error = "ZSTD_createDCtx() failed";
 		return false;
 	}
+	if (opt.dict) {
+		ZSTD_DCtx_refDDict(dctx, opt.dict->ddict());
+	}
 
 	const size_t toRead = buffInSize;
 	filesize_t total = 0;
@@ -90,7 +176,10 @@ bool ZS::decompress(Option const &opt, std::function<int (char *, int)> in_fn, s
 			}
 			// Write decompressed data
 			const int len = (int)output.pos;
-			out_fn(buffOut, len);
+			if (len > 0 && out_fn(buffOut, len) != len) {
+				error = "failed to write decompressed data";
+				return false;
+			}
 			total += len;
 			// Check if reached maximum length
 			if (maxlen != (filesize_t)-1 && total >= maxlen) {
@@ -107,75 +196,830 @@ done:;
 }
 
 /**
- * @brief Compress data using Zstandard
- * @param opt Compression options (includes compression level)
- * @param in_fn Input callback function to read uncompressed data
- * @param out_fn Output callback function to write compressed data
+ * @brief Decompress independent frames in parallel
+ *
+ * Compressed frames are read sequentially by read_fn on the calling thread,
+ * decompressed on a pool of worker threads and passed to out_fn in their
+ * original order. At most two frames per worker are held in memory.
+ * @param opt Decompression options (nbworkers selects the number of threads)
+ * @param frames Frames to decompress
+ * @param read_fn Callback function to read the compressed data of a frame
+ * @param out_fn Callback function receiving the decompressed data of each frame
  * @return true if successful, false otherwise
  */
-bool ZS::compress(Option const &opt, std::function<int (char *, int)> const &in_fn, std::function<int (char const *, int)> const &out_fn)
+bool ZS::decompress_frames(Option const &opt, std::vector<Frame> const &frames, std::function<bool (Frame const &, std::vector<char> *)> const &read_fn, std::function<bool (std::vector<char> &&)> const &out_fn)
 {
 	error = {};
 
-	const int CLEVEL = opt.clevel; //ZSTD_CLEVEL_DEFAULT;
+	const int nbworkers = std::max(worker_count(opt.nbworkers), 1);
 
-	// Allocate input and output buffers
-	const size_t buffInSize = ZSTD_CStreamInSize();
-	const size_t buffOutSize = ZSTD_CStreamOutSize();
-	std::unique_ptr<char> buffer(new char [buffInSize + buffOutSize]);
-	char *const buffIn = buffer.get();
-	char *const buffOut = buffIn + buffInSize;
+	// One decompression context per worker
+	std::vector<std::unique_ptr<Context<ZSTD_DCtx>>> dctx;
+	for (int i = 0; i < nbworkers; i++) {
+		dctx.emplace_back(new Context<ZSTD_DCtx>(ZSTD_createDCtx()));
+		if (!*dctx.back()) {
+			error = "ZSTD_createDCtx() failed";
+			return false;
+		}
+		if (opt.dict) {
+			ZSTD_DCtx_refDDict(*dctx.back(), opt.dict->ddict());
+		}
+	}
+
+	struct Job {
+		std::vector<char> src;
+		size_t size = 0;
+	};
+	struct Result {
+		std::vector<char> data;
+		std::string error;
+	};
+	OrderedPool<Job, Result> pool(nbworkers, [&](int worker, Job &in, Result *out){
+		out->error = decompress_frame(*dctx[worker], in.src.data(), in.src.size(), in.size, &out->data);
+		std::vector<char>().swap(in.src);
+	});
+
+	// Pass finished frames to out_fn until at most limit frames are outstanding
+	auto Drain = [&](size_t limit){
+		Result r;
+		while (pool.size() > limit) {
+			pool.pop(&r);
+			if (!r.error.empty()) {
+				error = r.error;
+				return false;
+			}
+			if (!out_fn(std::move(r.data))) {
+				error = "failed to write decompressed data";
+				return false;
+			}
+		}
+		return true;
+	};
+
+	for (Frame const &frame : frames) {
+		Job job;
+		job.size = frame.decompressed_size;
+		if (!read_fn(frame, &job.src)) {
+			error = "failed to read compressed data";
+			return false;
+		}
+		pool.push(std::move(job));
+		if (!Drain(2 * nbworkers)) return false;
+	}
+	return Drain(0);
+}
+
+/**
+ * @brief Read the seek table of a seekable archive
+ *
+ * The seek table is a skippable frame at the end of the file (zstd
+ * seekable format). It is accepted only if it describes the whole file
+ * with frames of at most MAX_FRAME_SIZE bytes.
+ * @param pread_fn Callback function to read len bytes at offset
+ * @param file_size Size of the archive file
+ * @param out Output vector for the frames
+ * @return true if a valid seek table was found, false otherwise
+ */
+bool ZS::read_seek_table(std::function<bool (char *, size_t, uint64_t)> const &pread_fn, uint64_t file_size, std::vector<Frame> *out)
+{
+	out->clear();
+
+	// Footer: number of frames, descriptor and magic number
+	char footer[9];
+	if (file_size < 8 + sizeof(footer)) return false;
+	if (!pread_fn(footer, sizeof(footer), file_size - sizeof(footer))) return false;
+	if (get_le32(footer + 5) != SEEKABLE_MAGIC) return false;
+	const uint32_t n = get_le32(footer);
+	const unsigned char desc = (unsigned char)footer[4];
+	if (desc & 0x7c) return false; // reserved bits
+	const size_t entry_size = (desc & 0x80) ? 12 : 8;
+
+	const uint64_t table_size = 8 + (uint64_t)n * entry_size + sizeof(footer);
+	if (table_size > file_size) return false;
+	std::vector<char> table(table_size);
+	if (!pread_fn(table.data(), table.size(), file_size - table_size)) return false;
+	if (get_le32(table.data()) != SEEKABLE_SKIPPABLE_MAGIC) return false;
+	if (get_le32(table.data() + 4) != table_size - 8) return false;
 
-	// Create compression context
-	Context<ZSTD_CCtx> cctx(ZSTD_createCCtx());
-	if (!cctx) {
-		error = "ZSTD_createCCtx() failed";
+	uint64_t coffset = 0;
+	uint64_t doffset = 0;
+	char const *p = table.data() + 8;
+	for (uint32_t i = 0; i < n; i++) {
+		Frame f;
+		f.compressed_offset = coffset;
+		f.compressed_size = get_le32(p);
+		f.decompressed_offset = doffset;
+		f.decompressed_size = get_le32(p + 4);
+		if (f.compressed_size > MAX_FRAME_SIZE || f.decompressed_size > MAX_FRAME_SIZE) {
+			out->clear();
+			return false;
+		}
+		coffset += f.compressed_size;
+		doffset += f.decompressed_size;
+		out->push_back(f);
+		p += entry_size;
+	}
+	if (coffset + table_size != file_size) {
+		out->clear();
 		return false;
 	}
+	return true;
+}
+
+/**
+ * @brief Locate the zstd frames of an archive held in memory
+ *
+ * Skippable frames are omitted from the result.
+ * @param data Pointer to compressed data
+ * @param size Size of compressed data
+ * @param out Output vector for the frames
+ * @return true if the data consists of complete frames of up to
+ * MAX_FRAME_SIZE bytes, false otherwise
+ */
+bool ZS::scan_frames(char const *data, size_t size, std::vector<Frame> *out)
+{
+	out->clear();
+	uint64_t offset = 0;
+	uint64_t doffset = 0;
+	while (offset < size) {
+		const size_t n = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+		if (ZSTD_isError(n)) {
+			out->clear();
+			return false;
+		}
+		if (size - offset >= 4 && (get_le32(data + offset) & 0xFFFFFFF0) == 0x184D2A50) {
+			// Skippable frame
+			offset += n;
+			continue;
+		}
+		Frame f;
+		f.compressed_offset = offset;
+		f.compressed_size = n;
+		f.decompressed_offset = doffset;
+		const unsigned long long dsize = ZSTD_getFrameContentSize(data + offset, size - offset);
+		if (dsize == ZSTD_CONTENTSIZE_ERROR || (dsize != ZSTD_CONTENTSIZE_UNKNOWN && dsize > MAX_FRAME_SIZE) || n > MAX_FRAME_SIZE) {
+			// Decompressed as a stream instead of frame by frame
+			out->clear();
+			return false;
+		}
+		if (dsize != ZSTD_CONTENTSIZE_UNKNOWN) {
+			f.decompressed_size = dsize;
+			doffset += dsize;
+		}
+		out->push_back(f);
+		offset += n;
+	}
+	return true;
+}
+
+namespace {
 
+/**
+ * @brief Apply compression parameters to a context
+ * @param cctx Compression context
+ * @param opt Compression options
+ * @param nbworkers Number of zstd worker threads (0 for single-threaded)
+ * @return zstd result code
+ */
+size_t init_cctx(ZSTD_CCtx *cctx, ZS::Option const &opt, int nbworkers)
+{
 	size_t ret;
 	// Set compression level
-	ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, CLEVEL);
-	if (ZSTD_isError(ret)) {
-		error = ZSTD_getErrorName(ret);
-		return false;
-	}
+	ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, opt.clevel);
+	if (ZSTD_isError(ret)) return ret;
 	// Enable checksum for data integrity
 	ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
-	if (ZSTD_isError(ret)) {
-		error = ZSTD_getErrorName(ret);
+	if (ZSTD_isError(ret)) return ret;
+	// Shared dictionary
+	if (opt.dict) {
+		ret = ZSTD_CCtx_refCDict(cctx, opt.dict->cdict());
+		if (ZSTD_isError(ret)) return ret;
+	}
+	// Multithreaded compression
+	if (nbworkers > 0) {
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, nbworkers);
+		if (ZSTD_isError(ret)) return ret;
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize, opt.jobsize);
+		if (ZSTD_isError(ret)) return ret;
+		ret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_overlapLog, opt.overlaplog);
+		if (ZSTD_isError(ret)) return ret;
+	}
+	return 0;
+}
+
+// Raw (stored) frames: magic, frame header descriptor with only the
+// content checksum flag set, and a window descriptor for 128 KB windows,
+// which is also the largest raw block.
+const uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+const char RAW_FRAME_DESCRIPTOR = 0x04;
+const char RAW_WINDOW_DESCRIPTOR = 0x38;
+const size_t RAW_BLOCK_SIZE = 128 << 10;
+
+/**
+ * @brief Append the header of a raw frame
+ */
+void put_raw_frame_header(std::vector<char> *out)
+{
+	char header[6];
+	put_le32(header, ZSTD_FRAME_MAGIC);
+	header[4] = RAW_FRAME_DESCRIPTOR;
+	header[5] = RAW_WINDOW_DESCRIPTOR;
+	out->insert(out->end(), header, header + sizeof(header));
+}
+
+/**
+ * @brief Append data as raw blocks (not the last block of the frame)
+ */
+void put_raw_blocks(char const *ptr, size_t len, std::vector<char> *out)
+{
+	while (len > 0) {
+		const size_t n = std::min(len, RAW_BLOCK_SIZE);
+		const uint32_t header = (uint32_t)n << 3; // not last, type raw
+		out->push_back((char)header);
+		out->push_back((char)(header >> 8));
+		out->push_back((char)(header >> 16));
+		out->insert(out->end(), ptr, ptr + n);
+		ptr += n;
+		len -= n;
+	}
+}
+
+/**
+ * @brief Append the end of a raw frame: an empty last block and the content checksum
+ */
+void put_raw_frame_end(uint64_t hash, std::vector<char> *out)
+{
+	char tail[7] = { 1, 0, 0 }; // last block, type raw, size 0
+	put_le32(tail + 3, (uint32_t)hash);
+	out->insert(out->end(), tail, tail + sizeof(tail));
+}
+
+/**
+ * @brief Input of a frame compressed on a worker thread
+ */
+struct FrameJob {
+	std::vector<char> data;
+	bool store = false; // write a raw frame instead of compressing
+};
+
+/**
+ * @brief Result of compressing one frame on a worker thread
+ */
+struct FrameResult {
+	std::vector<char> data;
+	size_t srcsize = 0;
+	std::string error;
+};
+
+} // namespace
+
+struct ZS::Compressor::Private {
+	Option opt;
+	Context<ZSTD_CCtx> cctx { ZSTD_createCCtx() };
+	std::function<int (char const *, int)> out_fn;
+	std::vector<char> buffOut;
+	std::string error;
+	bool failed = false;
+
+	// Seekable format state
+	uint64_t frame_in = 0; // uncompressed bytes in the current frame
+	uint64_t frame_out = 0; // compressed bytes of the current frame written so far
+	size_t frames = 0; // number of frames ended so far
+	std::vector<std::pair<uint32_t, uint32_t>> seek_table; // compressed size, decompressed size
+
+	// Frames are compressed independently on worker threads
+	std::vector<char> frame;
+	std::vector<std::unique_ptr<Context<ZSTD_CCtx>>> worker_cctx;
+	std::unique_ptr<OrderedPool<FrameJob, FrameResult>> pool;
+	size_t pool_bytes = 0; // uncompressed bytes of the frames in the pool
+
+	// Store mode: data goes out uncompressed in raw frames
+	bool store = false;
+	bool raw_open = false; // a raw frame has been started
+	XXH64_state_t xxh;
+	std::vector<char> rawbuf;
+
+	bool fail(std::string const &msg)
+	{
+		error = msg;
+		failed = true;
 		return false;
 	}
+	bool output(char const *ptr, size_t len)
+	{
+		if (len > 0 && out_fn(ptr, (int)len) != (int)len) {
+			return fail("failed to write compressed data");
+		}
+		frame_out += len;
+		return true;
+	}
+	bool stream(char const *ptr, size_t len, ZSTD_EndDirective mode);
+	bool store_data(char const *ptr, size_t len);
+	bool close_frame();
+	bool emit(FrameResult const &r);
+	bool drain(size_t limit);
+};
 
-	const size_t toRead = buffInSize;
+/**
+ * @brief Compress data with the streaming context
+ * @param ptr Pointer to uncompressed data
+ * @param len Length of data
+ * @param mode ZSTD_e_continue, or ZSTD_e_end to close the frame
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::Private::stream(char const *ptr, size_t len, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer input = { ptr, len, 0 };
 	while (1) {
-		// Read uncompressed data
-		const int read = in_fn(buffIn, (int)toRead);
-		if (read < 0) return false;
-		const bool lastChunk = (read == 0);
-		const ZSTD_EndDirective mode = lastChunk ? ZSTD_e_end : ZSTD_e_continue;
-		ZSTD_inBuffer input = { buffIn, (size_t)read, 0 };
-		int finished;
-		do {
-			// Compress data in streaming mode
-			ZSTD_outBuffer output = { buffOut, buffOutSize, 0 };
-			const size_t remaining = ZSTD_compressStream2(cctx, &output , &input, mode);
-			if (ZSTD_isError(remaining)) {
-				error = ZSTD_getErrorName(remaining);
-				return false;
+		// Compress data in streaming mode
+		ZSTD_outBuffer output = { buffOut.data(), buffOut.size(), 0 };
+		const size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+		if (ZSTD_isError(remaining)) {
+			return fail(ZSTD_getErrorName(remaining));
+		}
+		// Write compressed data
+		if (!this->output(buffOut.data(), output.pos)) return false;
+		if (mode == ZSTD_e_end ? (remaining == 0) : (input.pos == input.size)) break;
+	}
+	return true;
+}
+
+/**
+ * @brief Write data uncompressed as raw blocks, starting a raw frame if necessary
+ * @param ptr Pointer to data
+ * @param len Length of data
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::Private::store_data(char const *ptr, size_t len)
+{
+	rawbuf.clear();
+	if (!raw_open) {
+		put_raw_frame_header(&rawbuf);
+		XXH64_reset(&xxh, 0);
+		raw_open = true;
+	}
+	XXH64_update(&xxh, ptr, len);
+	while (len > 0) {
+		// Keep the staging buffer small
+		const size_t n = std::min(len, 8 * RAW_BLOCK_SIZE);
+		put_raw_blocks(ptr, n, &rawbuf);
+		if (!output(rawbuf.data(), rawbuf.size())) return false;
+		rawbuf.clear();
+		ptr += n;
+		len -= n;
+	}
+	return output(rawbuf.data(), rawbuf.size());
+}
+
+/**
+ * @brief End the current frame of the streaming context, compressed or raw
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::Private::close_frame()
+{
+	if (raw_open) {
+		rawbuf.clear();
+		put_raw_frame_end(XXH64_digest(&xxh), &rawbuf);
+		raw_open = false;
+		return output(rawbuf.data(), rawbuf.size());
+	}
+	return stream(nullptr, 0, ZSTD_e_end);
+}
+
+/**
+ * @brief Write a frame compressed by a worker and record it in the seek table
+ * @param r Compression result
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::Private::emit(FrameResult const &r)
+{
+	if (!r.error.empty()) {
+		return fail(r.error);
+	}
+	if (!output(r.data.data(), r.data.size())) return false;
+	pool_bytes -= r.srcsize;
+	seek_table.emplace_back((uint32_t)r.data.size(), (uint32_t)r.srcsize);
+	frame_out = 0;
+	return true;
+}
+
+/**
+ * @brief Write finished frames until at most limit frames are outstanding
+ * @param limit Maximum number of outstanding frames
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::Private::drain(size_t limit)
+{
+	FrameResult r;
+	// Write whatever is already finished without waiting
+	while (pool->pop(&r, false)) {
+		if (!emit(r)) return false;
+	}
+	while (pool->size() > limit) {
+		pool->pop(&r);
+		if (!emit(r)) return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Constructor for Compressor
+ *
+ * If opt.frame_size is nonzero the output is cut into independent frames
+ * of at most that many uncompressed bytes, followed by a seek table in the
+ * zstd seekable format. Such frames are compressed in parallel when worker
+ * threads are requested.
+ * @param opt Compression options (includes compression level)
+ * @param out_fn Output callback function to write compressed data
+ */
+ZS::Compressor::Compressor(Option const &opt, std::function<int (char const *, int)> out_fn)
+	: m(new Private)
+{
+	m->opt = opt;
+	m->out_fn = out_fn;
+	m->buffOut.resize(ZSTD_CStreamOutSize());
+
+	if (!m->cctx) {
+		m->fail("ZSTD_createCCtx() failed");
+		return;
+	}
+
+	int nbworkers = worker_count(opt.nbworkers);
+
+	if (opt.frame_size > MAX_FRAME_SIZE) {
+		m->opt.frame_size = MAX_FRAME_SIZE;
+	}
+
+	if (m->opt.frame_size > 0 && nbworkers > 0) {
+		// Each worker compresses whole frames with its own context
+		for (int i = 0; i < nbworkers; i++) {
+			m->worker_cctx.emplace_back(new Context<ZSTD_CCtx>(ZSTD_createCCtx()));
+			ZSTD_CCtx *cctx = *m->worker_cctx.back();
+			if (!cctx) {
+				m->fail("ZSTD_createCCtx() failed");
+				return;
+			}
+			size_t ret = init_cctx(cctx, m->opt, 0);
+			if (ZSTD_isError(ret)) {
+				m->fail(ZSTD_getErrorName(ret));
+				return;
+			}
+		}
+		m->pool.reset(new OrderedPool<FrameJob, FrameResult>(nbworkers, [this](int worker, FrameJob &in, FrameResult *out){
+			out->srcsize = in.data.size();
+			if (in.store) {
+				out->data.reserve(in.data.size() + in.data.size() / RAW_BLOCK_SIZE * 3 + 16);
+				put_raw_frame_header(&out->data);
+				put_raw_blocks(in.data.data(), in.data.size(), &out->data);
+				put_raw_frame_end(XXH64(in.data.data(), in.data.size(), 0), &out->data);
+			} else {
+				ZSTD_CCtx *cctx = *m->worker_cctx[worker];
+				out->data.resize(ZSTD_compressBound(in.data.size()));
+				size_t n = ZSTD_compress2(cctx, out->data.data(), out->data.size(), in.data.data(), in.data.size());
+				if (ZSTD_isError(n)) {
+					out->error = ZSTD_getErrorName(n);
+					return;
+				}
+				out->data.resize(n);
 			}
-			// Write compressed data
-			out_fn(buffOut, (int)output.pos);
-			finished = lastChunk ? (remaining == 0) : (input.pos == input.size);
-		} while (!finished);
+			std::vector<char>().swap(in.data);
+		}));
+		nbworkers = 0;
+	}
+
+	size_t ret = init_cctx(m->cctx, m->opt, nbworkers);
+	if (ZSTD_isError(ret)) {
+		m->fail(ZSTD_getErrorName(ret));
+		return;
+	}
+}
+
+ZS::Compressor::~Compressor()
+{
+	delete m;
+}
+
+/**
+ * @brief Get the last error message
+ * @return Error message (empty if no error occurred)
+ */
+std::string const &ZS::Compressor::error() const
+{
+	return m->error;
+}
+
+/**
+ * @brief Feed uncompressed data to the compressor
+ *
+ * The data is consumed directly from the caller's buffer; compressed output
+ * is handed to the output callback as soon as zstd produces it, so memory
+ * usage stays bounded by the internal zstd buffers.
+ * @param ptr Pointer to uncompressed data
+ * @param len Length of data
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::write(char const *ptr, size_t len)
+{
+	if (m->failed) return false;
+
+	const uint64_t frame_size = m->opt.frame_size;
+	while (len > 0) {
+		size_t n = len;
+		if (frame_size > 0) {
+			n = (size_t)std::min((uint64_t)n, frame_size - m->frame_in);
+		}
+		if (m->pool) {
+			m->frame.insert(m->frame.end(), ptr, ptr + n);
+		} else if (m->store) {
+			if (!m->store_data(ptr, n)) return false;
+		} else if (!m->stream(ptr, n, ZSTD_e_continue)) {
+			return false;
+		}
+		m->frame_in += n;
+		ptr += n;
+		len -= n;
+		// Close the frame when it reached the frame size
+		if (frame_size > 0 && m->frame_in >= frame_size) {
+			if (!end_frame()) return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Notify the compressor that a new tar entry starts
+ *
+ * In seekable mode the current frame is closed early if the entry would
+ * not fit into it, so that frames start at entry boundaries wherever
+ * possible. Entries larger than the frame size still span several frames.
+ * @param size Number of bytes the entry occupies in the uncompressed stream
+ * @return false if the compressor has failed
+ */
+bool ZS::Compressor::mark_entry(uint64_t size)
+{
+	if (m->opt.frame_size > 0 && m->frame_in > 0 && m->frame_in + size > m->opt.frame_size) {
+		return end_frame();
+	}
+	return !m->failed;
+}
+
+/**
+ * @brief Close the current frame (seekable mode only)
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::end_frame()
+{
+	if (m->failed) return false;
+	if (m->opt.frame_size == 0) return true;
+
+	if (m->pool) {
+		FrameJob job;
+		job.data = std::move(m->frame);
+		job.store = m->store;
+		m->pool_bytes += job.data.size();
+		m->pool->push(std::move(job));
+		m->frame = {};
+		m->frame.reserve(m->opt.frame_size);
+		// Keep at most two frames per worker in flight
+		if (!m->drain(2 * m->pool->threads())) return false;
+	} else {
+		if (!m->close_frame()) return false;
+		m->seek_table.emplace_back((uint32_t)m->frame_out, (uint32_t)m->frame_in);
+	}
+	m->frame_in = 0;
+	m->frame_out = 0;
+	m->frames++;
+	return true;
+}
+
+/**
+ * @brief Switch between compressing and storing
+ *
+ * Stored data is written uncompressed as raw blocks of a regular zstd
+ * frame, which any decoder accepts. Switching ends the current frame, so
+ * compressed and stored data never share a frame.
+ * @param store true to store subsequent data, false to compress it
+ */
+void ZS::Compressor::set_store(bool store)
+{
+	if (m->failed || store == m->store) return;
+	if (m->frame_in > 0) {
+		if (m->opt.frame_size > 0) {
+			end_frame();
+		} else if (m->close_frame()) {
+			m->frame_in = 0;
+		}
+	}
+	m->store = store;
+}
+
+/**
+ * @brief Get the amount of memory held by the compressor
+ *
+ * Counts the zstd context with its internal buffers, the staging buffers
+ * and the data of frames waiting in the worker pool.
+ * @return Bytes held
+ */
+size_t ZS::Compressor::buffered() const
+{
+	size_t n = ZSTD_sizeof_CCtx(m->cctx) + m->buffOut.capacity() + m->frame.capacity() + m->rawbuf.capacity();
+	return n + m->pool_bytes;
+}
+
+/**
+ * @brief Get the index of the frame that receives the next data (seekable mode)
+ * @return Frame index
+ */
+size_t ZS::Compressor::frame_index() const
+{
+	return m->frames;
+}
+
+/**
+ * @brief Close the current frame and write a skippable frame
+ *
+ * In seekable mode the skippable frame is recorded in the seek table as a
+ * frame without decompressed content, so the table keeps describing the
+ * whole file.
+ * @param magic Skippable frame magic number (0x184D2A50 to 0x184D2A5F)
+ * @param ptr Pointer to frame content
+ * @param len Length of frame content
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::write_skippable(uint32_t magic, char const *ptr, size_t len)
+{
+	if (m->failed) return false;
+	if (m->opt.frame_size > 0) {
+		if (m->frame_in > 0 && !end_frame()) return false;
+		// Everything before the skippable frame must have been written
+		if (m->pool && !m->drain(0)) return false;
+	} else if (m->frame_in > 0) {
+		if (!m->close_frame()) return false;
+		m->frame_in = 0;
+	}
+	char header[8];
+	put_le32(header, magic);
+	put_le32(header + 4, (uint32_t)len);
+	m->frame_out = 0;
+	if (!m->output(header, sizeof(header))) return false;
+	if (!m->output(ptr, len)) return false;
+	if (m->opt.frame_size > 0) {
+		m->seek_table.emplace_back((uint32_t)m->frame_out, 0);
+		m->frames++;
+	}
+	m->frame_out = 0;
+	return true;
+}
+
+/**
+ * @brief Flush remaining data and write the end of the zstd frame
+ *
+ * In seekable mode the seek table is appended as a skippable frame.
+ * @return true if successful, false otherwise
+ */
+bool ZS::Compressor::finish()
+{
+	if (m->failed) return false;
+
+	if (m->opt.frame_size == 0) {
+		if (m->raw_open) return m->close_frame();
+		return m->stream(nullptr, 0, ZSTD_e_end);
+	}
+
+	if (m->frame_in > 0 || m->frames == 0) {
+		if (!end_frame()) return false;
+	}
+	if (m->pool && !m->drain(0)) return false;
+
+	// Seek table: entries, number of frames, descriptor and magic number
+	std::vector<char> table(8 + m->seek_table.size() * 8 + 9);
+	char *p = table.data();
+	put_le32(p, SEEKABLE_SKIPPABLE_MAGIC);
+	put_le32(p + 4, (uint32_t)(table.size() - 8));
+	p += 8;
+	for (auto const &e : m->seek_table) {
+		put_le32(p, e.first);
+		put_le32(p + 4, e.second);
+		p += 8;
+	}
+	put_le32(p, (uint32_t)m->seek_table.size());
+	p[4] = 0; // no per-frame checksums, each frame carries its own
+	put_le32(p + 5, SEEKABLE_MAGIC);
+	return m->output(table.data(), table.size());
+}
+
+/**
+ * @brief Compress data using Zstandard
+ * @param opt Compression options (includes compression level)
+ * @param in_fn Input callback function to read uncompressed data
+ * @param out_fn Output callback function to write compressed data
+ * @return true if successful, false otherwise
+ */
+bool ZS::compress(Option const &opt, std::function<int (char *, int)> const &in_fn, std::function<int (char const *, int)> const &out_fn)
+{
+	error = {};
 
-		if (input.pos != input.size) {
-			error = "zstd only returns 0 when the input is completely consumed";
+	// Allocate input buffer
+	std::vector<char> buffIn(ZSTD_CStreamInSize());
+
+	Compressor compressor(opt, out_fn);
+	while (1) {
+		// Read uncompressed data
+		const int read = in_fn(buffIn.data(), (int)buffIn.size());
+		if (read < 0) return false;
+		if (read == 0) break;
+		if (!compressor.write(buffIn.data(), read)) {
+			error = compressor.error();
 			return false;
 		}
-		if (lastChunk) break;
+	}
+	if (!compressor.finish()) {
+		error = compressor.error();
+		return false;
 	}
 
 	return true;
 }
 
+/**
+ * @brief Train a dictionary from samples
+ * @param samples Samples, concatenated
+ * @param sizes Size of each sample
+ * @param capacity Maximum size of the dictionary
+ * @param out Output dictionary
+ * @return true if successful, false otherwise
+ */
+bool ZS::train_dictionary(std::vector<char> const &samples, std::vector<size_t> const &sizes, size_t capacity, std::vector<char> *out)
+{
+	error = {};
+	out->resize(capacity);
+	const size_t n = ZDICT_trainFromBuffer(out->data(), out->size(), samples.data(), sizes.data(), (unsigned)sizes.size());
+	if (ZDICT_isError(n)) {
+		error = ZDICT_getErrorName(n);
+		out->clear();
+		return false;
+	}
+	out->resize(n);
+	return true;
+}
+
+struct ZS::Dictionary::Private {
+	std::vector<char> data;
+	int clevel;
+	std::once_flag cdict_once;
+	std::once_flag ddict_once;
+	ZSTD_CDict *cdict = nullptr;
+	ZSTD_DDict *ddict = nullptr;
+};
+
+/**
+ * @brief Constructor for Dictionary
+ *
+ * The digested dictionaries are created on first use and can be shared by
+ * any number of contexts and threads.
+ * @param data Dictionary content
+ * @param clevel Compression level the compression dictionary is made for
+ */
+ZS::Dictionary::Dictionary(std::vector<char> &&data, int clevel)
+	: m(new Private)
+{
+	m->data = std::move(data);
+	m->clevel = clevel;
+}
+
+ZS::Dictionary::~Dictionary()
+{
+	ZSTD_freeCDict(m->cdict);
+	ZSTD_freeDDict(m->ddict);
+	delete m;
+}
+
+/**
+ * @brief Get the dictionary content
+ */
+std::vector<char> const &ZS::Dictionary::data() const
+{
+	return m->data;
+}
+
+/**
+ * @brief Get the digested dictionary for compression
+ */
+ZSTD_CDict const *ZS::Dictionary::cdict() const
+{
+	std::call_once(m->cdict_once, [this](){
+		m->cdict = ZSTD_createCDict(m->data.data(), m->data.size(), m->clevel);
+	});
+	return m->cdict;
+}
+
+/**
+ * @brief Get the digested dictionary for decompression
+ */
+ZSTD_DDict const *ZS::Dictionary::ddict() const
+{
+	std::call_once(m->ddict_once, [this](){
+		m->ddict = ZSTD_createDDict(m->data.data(), m->data.size());
+	});
+	return m->ddict;
+}
@@ -1,20 +1,76 @@
 #ifndef ZS_H
 #define ZS_H
 
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 #include <zstd.h>
 
 class ZS {
 private:
 public:
+	class Dictionary;
 	struct Option {
 		int clevel = ZSTD_CLEVEL_DEFAULT;
+		int nbworkers = 0; // 0: single-threaded, <0: one worker per core
+		int jobsize = 0; // 0: automatic
+		int overlaplog = 0; // 0: automatic
+		uint64_t frame_size = 0; // >0: independent frames of this size plus a seek table
+		std::shared_ptr<Dictionary const> dict; // shared dictionary (nullptr: none)
+	};
+	static constexpr uint32_t SEEKABLE_SKIPPABLE_MAGIC = 0x184D2A5E;
+	static constexpr uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+	static constexpr uint64_t MAX_FRAME_SIZE = 1 << 30;
+	struct Frame {
+		uint64_t compressed_offset = 0;
+		uint64_t compressed_size = 0;
+		uint64_t decompressed_offset = 0;
+		uint64_t decompressed_size = 0; // 0 if unknown
 	};
 	using filesize_t = size_t;
 	std::string error;
 	bool decompress(Option const &opt, std::function<int (char *, int)> in_fn, std::function<int (const char *, int)> out_fn, filesize_t maxlen = -1);
+	bool decompress_frames(Option const &opt, std::vector<Frame> const &frames, std::function<bool (Frame const &frame, std::vector<char> *out)> const &read_fn, std::function<bool (std::vector<char> &&data)> const &out_fn);
+	static bool read_seek_table(std::function<bool (char *ptr, size_t len, uint64_t offset)> const &pread_fn, uint64_t file_size, std::vector<Frame> *out);
+	static bool scan_frames(char const *data, size_t size, std::vector<Frame> *out);
 	bool compress(Option const &opt, std::function<int (char *, int)> const &in_fn, std::function<int (char const *, int)> const &out_fn);
+	bool train_dictionary(std::vector<char> const &samples, std::vector<size_t> const &sizes, size_t capacity, std::vector<char> *out);
+
+	class Dictionary {
+	private:
+		struct Private;
+		Private *m;
+	public:
+		Dictionary(std::vector<char> &&data, int clevel = ZSTD_CLEVEL_DEFAULT);
+		~Dictionary();
+		Dictionary(Dictionary const &) = delete;
+		Dictionary &operator = (Dictionary const &) = delete;
+		std::vector<char> const &data() const;
+		ZSTD_CDict const *cdict() const;
+		ZSTD_DDict const *ddict() const;
+	};
+
+	class Compressor {
+	private:
+		struct Private;
+		Private *m;
+	public:
+		Compressor(Option const &opt, std::function<int (char const *, int)> out_fn);
+		~Compressor();
+		Compressor(Compressor const &) = delete;
+		Compressor &operator = (Compressor const &) = delete;
+		std::string const &error() const;
+		bool write(char const *ptr, size_t len);
+		bool mark_entry(uint64_t size);
+		bool end_frame();
+		void set_store(bool store);
+		size_t frame_index() const;
+		size_t buffered() const;
+		bool write_skippable(uint32_t magic, char const *ptr, size_t len);
+		bool finish();
+	};
 };
 
 #endif // ZS_H